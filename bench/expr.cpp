@@ -0,0 +1,65 @@
+// Compares a shape_expr against the same shape as a JS function.
+//
+// Build with: cmake .. -DMIDIGYVER_BENCHMARKS=ON && make bench_expr
+
+#include <chrono>
+#include <iostream>
+
+#include "JSContext.h"
+#include "Expression.h"
+
+int main() {
+    const size_t total = 1000000;
+
+    const char* exprs[] = { "value * 2 - 10", "value > 64", "clamp(value * global.gain, 0, 127)" };
+    const char* fncs[] = {
+        "function(value) { return value * 2 - 10; }",
+        "function(value) { return value > 64; }",
+        "function(value) { return Math.min(Math.max(value * global.gain, 0), 127); }"
+    };
+
+    JSContext js;
+    js.setFunction(0, "function() { return { gain: 1.5 }; }");
+    js.setGlobalValue("global", js.getFunctionResult(0));
+
+    for (size_t t = 0; t < 3; t++) {
+        Expression expr;
+        if (!expr.compile(exprs[t])) {
+            std::cout << expr.error << std::endl;
+            return 1;
+        }
+        js.setFunction(1, fncs[t]);
+
+        double checksum_js = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < total; i++) {
+            float value = float(i % 128);
+            JSScopeMarker marker = js.getScopeMarker();
+            js.pushFunction(1);
+            js.newNumber(value);
+            JSValue result = js.callFunction(1);
+            if (result.isNumber())
+                checksum_js += result.toFloat();
+            else if (result.isBoolean() && result.toBool())
+                checksum_js += value;
+            js.resetToScopeMarker(marker);
+        }
+        double js_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        double checksum_expr = 0.0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < total; i++) {
+            float value = float(i % 128);
+            if (expr.eval(js, &value, 0, 0))
+                checksum_expr += value;
+        }
+        double expr_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << exprs[t] << std::endl;
+        std::cout << "  js         : " << js_ns / total << " ns/call (checksum " << checksum_js << ")" << std::endl;
+        std::cout << "  shape_expr : " << expr_ns / total << " ns/call (checksum " << checksum_expr << ")" << std::endl;
+        std::cout << "  speed up   : " << js_ns / expr_ns << "x" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Compares the old std::map key lookup against the dense Device tables
+// over 10k random MIDI events.
+//
+// Build with: cmake .. -DMIDIGYVER_BENCHMARKS=ON && make bench_keymap
+
+#include <map>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+
+#include "Device.h"
+
+// std::map implementation Device used to have
+class MapDevice {
+public:
+    void    setKeyFnc(size_t _channel, size_t _key, size_t _fnc) {
+        size_t offset = _channel * 127;
+        keyMap[offset + _key] = _fnc;
+    }
+
+    bool    isKeyFnc(size_t _channel, size_t _key) {
+        if (keyMap.find(_key) != keyMap.end())
+            return true;
+
+        size_t offset = _channel * 127;
+        return keyMap.find(offset + _key) != keyMap.end();
+    }
+
+    size_t  getKeyFnc(size_t _channel, size_t _key) {
+        if (keyMap.find(_key) != keyMap.end())
+            return keyMap[_key];
+
+        size_t offset = size_t(_channel) * 127;
+        return keyMap[offset + _key];
+    }
+
+    std::map<size_t, size_t> keyMap;
+};
+
+class TableDevice : public Device {
+};
+
+struct Event {
+    size_t channel;
+    size_t key;
+};
+
+int main() {
+    const size_t total_events = 10000;
+    const size_t rounds = 1000;
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> channels(1, 16);
+    std::uniform_int_distribution<size_t> keys(0, 127);
+
+    // Something that looks like a nanoKontrol2 config: omni faders, knobs and buttons
+    // plus a couple of channel specific keys
+    MapDevice oldDevice;
+    TableDevice newDevice;
+    size_t fnc = 0;
+    for (size_t k = 0; k < 72; k++, fnc++) {
+        oldDevice.setKeyFnc(0, k, fnc);
+        newDevice.setKeyFnc(0, k, fnc);
+    }
+    for (size_t c = 1; c <= 16; c++, fnc++) {
+        oldDevice.setKeyFnc(c, 100, fnc);
+        newDevice.setKeyFnc(c, 100, fnc);
+    }
+    newDevice.publishFncs();
+
+    std::vector<Event> events(total_events);
+    for (size_t i = 0; i < total_events; i++) {
+        events[i].channel = channels(rng);
+        events[i].key = keys(rng);
+    }
+
+    size_t checksum_old = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < total_events; i++)
+            if (oldDevice.isKeyFnc(events[i].channel, events[i].key))
+                checksum_old += oldDevice.getKeyFnc(events[i].channel, events[i].key);
+    double old_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    size_t checksum_new = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < total_events; i++) {
+            int32_t f = newDevice.getKeyFnc(events[i].channel, events[i].key);
+            if (f >= 0)
+                checksum_new += f;
+        }
+    double new_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    double lookups = double(total_events * rounds);
+    std::cout << "std::map  : " << old_ns / lookups << " ns/event (checksum " << checksum_old << ")" << std::endl;
+    std::cout << "table     : " << new_ns / lookups << " ns/event (checksum " << checksum_new << ")" << std::endl;
+    std::cout << "speed up  : " << old_ns / new_ns << "x" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Compares building and serialising a message with liblo against patching
+// a pre-encoded OscTemplate, for a float and a color message.
+//
+// Build with: cmake .. -DMIDIGYVER_BENCHMARKS=ON && make bench_osc
+
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <iostream>
+
+#include "ops/osc.h"
+
+int main() {
+    const size_t total = 1000000;
+    const std::string address = "/nanoKontrol2/fader0";
+
+    // make sure both produce the same bytes
+    {
+        char a[OSC_BUFFER_SIZE];
+        char b[OSC_BUFFER_SIZE];
+        size_t a_size = sizeof(a);
+
+        lo_message m = lo_message_new();
+        lo_message_add_float(m, 0.5f);
+        lo_message_serialise(m, address.c_str(), a, &a_size);
+        lo_message_free(m);
+
+        OscTemplate tmpl;
+        tmpl.header = oscHeader(address, ",f");
+        size_t b_size = oscEncode(b, tmpl, 0.5f);
+
+        if (a_size != b_size || memcmp(a, b, a_size) != 0) {
+            std::cout << "template packet doesn't match liblo's" << std::endl;
+            return 1;
+        }
+    }
+
+    char buffer[OSC_BUFFER_SIZE];
+    size_t checksum_lo = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        lo_message m = lo_message_new();
+        lo_message_add_float(m, float(i % 128) / 127.0f);
+        size_t size = lo_message_length(m, address.c_str());
+        lo_message_serialise(m, address.c_str(), buffer, &size);
+        lo_message_free(m);
+        checksum_lo += size + (unsigned char)buffer[size - 1];
+    }
+    double lo_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    OscTemplate tmpl;
+    tmpl.header = oscHeader(address, ",f");
+    size_t checksum_tmpl = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        size_t size = oscEncode(buffer, tmpl, float(i % 128) / 127.0f);
+        checksum_tmpl += size + (unsigned char)buffer[size - 1];
+    }
+    double tmpl_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    size_t checksum_lo_color = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        float v = float(i % 128) / 127.0f;
+        lo_message m = lo_message_new();
+        lo_message_add_float(m, v);
+        lo_message_add_float(m, v);
+        lo_message_add_float(m, v);
+        lo_message_add_float(m, 1.0f);
+        size_t size = lo_message_length(m, address.c_str());
+        lo_message_serialise(m, address.c_str(), buffer, &size);
+        lo_message_free(m);
+        checksum_lo_color += size + (unsigned char)buffer[size - 5];
+    }
+    double lo_color_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    OscTemplate tmpl_color;
+    tmpl_color.header = oscHeader(address, ",ffff");
+    size_t checksum_tmpl_color = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        float v = float(i % 128) / 127.0f;
+        size_t size = oscEncode(buffer, tmpl_color, Color(v, v, v, 1.0f));
+        checksum_tmpl_color += size + (unsigned char)buffer[size - 5];
+    }
+    double tmpl_color_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "float liblo    : " << lo_ns / total << " ns/msg (checksum " << checksum_lo << ")" << std::endl;
+    std::cout << "float template : " << tmpl_ns / total << " ns/msg (checksum " << checksum_tmpl << ")" << std::endl;
+    std::cout << "color liblo    : " << lo_color_ns / total << " ns/msg (checksum " << checksum_lo_color << ")" << std::endl;
+    std::cout << "color template : " << tmpl_color_ns / total << " ns/msg (checksum " << checksum_tmpl_color << ")" << std::endl;
+    std::cout << "speed up       : " << lo_ns / tmpl_ns << "x / " << lo_color_ns / tmpl_color_ns << "x" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Compares calling a shape function the old way (event values as JS
+// globals and the binding's 'data' object rebuilt from YAML on every
+// call) against passing them as arguments with a 'data' object kept
+// between calls.
+//
+// Build with: cmake .. -DMIDIGYVER_BENCHMARKS=ON && make bench_shape
+
+#include <chrono>
+#include <iostream>
+
+#include "JSContext.h"
+#include "ops/nodes.h"
+
+int main() {
+    const size_t total = 200000;
+
+    YAML::Node node = YAML::Load(
+        "name: fader00\n"
+        "type: scalar\n"
+        "map: [0, 1]\n"
+        "min: 10\n");
+
+    JSContext js;
+    js.setFunction(0, "function() { return value * 0.5 + data.min; }");
+    js.setFunction(1, "function(value, key, channel, status, device, data) { return value * 0.5 + data.min; }");
+
+    {
+        JSScopeMarker marker = js.getScopeMarker();
+        js.setData(1, parseNode(js, node));
+        js.resetToScopeMarker(marker);
+    }
+
+    std::string device = "nanoKONTROL2";
+    std::string status = "CONTROLLER_CHANGE";
+
+    double checksum_old = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        JSScopeMarker marker = js.getScopeMarker();
+        js.setGlobalValue("device", js.newString(device));
+        js.setGlobalValue("status", js.newString(status));
+        js.setGlobalValue("channel", js.newNumber(1));
+        js.setGlobalValue("key", js.newNumber(i % 128));
+        js.setGlobalValue("value", js.newNumber(i % 128));
+        js.setGlobalValue("data", parseNode(js, node));
+        JSValue result = js.getFunctionResult(0);
+        if (result)
+            checksum_old += result.toFloat();
+        js.resetToScopeMarker(marker);
+    }
+    double old_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double checksum_new = 0.0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < total; i++) {
+        JSScopeMarker marker = js.getScopeMarker();
+        JSValue data = js.getData(1);
+        js.pushFunction(1);
+        js.newNumber(i % 128);
+        js.newNumber(i % 128);
+        js.newNumber(1);
+        js.newString(status);
+        js.newString(device);
+        data.ensureExistsOnStackTop();
+        JSValue result = js.callFunction(6);
+        if (result)
+            checksum_new += result.toFloat();
+        js.resetToScopeMarker(marker);
+    }
+    double new_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "globals   : " << total / old_s << " calls/sec (checksum " << checksum_old << ")" << std::endl;
+    std::cout << "arguments : " << total / new_s << " calls/sec (checksum " << checksum_new << ")" << std::endl;
+    std::cout << "speed up  : " << old_s / new_s << "x" << std::endl;
+
+    return 0;
+}
@@ -2986,6 +2986,9 @@ typedef struct duk_hthread duk_context;
 
 /* __OVERRIDE_DEFINES__ */
 
+/* midigyver: every change to the generated options is in this header */
+#include "duk_midigyver.h"
+
 /*
  *  Conditional includes
  */
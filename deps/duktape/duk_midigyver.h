@@ -0,0 +1,23 @@
+/*
+ *  midigyver overrides of the generated duk_config.h options.
+ *
+ *  Included from the override section at the end of duk_config.h, so
+ *  regenerating the config only needs that one #include put back.
+ */
+
+#if !defined(DUK_MIDIGYVER_H_INCLUDED)
+#define DUK_MIDIGYVER_H_INCLUDED
+
+/* Time budget of the shape functions, see jsExecTimeoutCheck() in JSContext.cpp */
+#undef DUK_USE_INTERRUPT_COUNTER
+#define DUK_USE_INTERRUPT_COUNTER
+#undef DUK_USE_EXEC_TIMEOUT_CHECK
+extern duk_bool_t jsExecTimeoutCheck(void *udata);
+#define DUK_USE_EXEC_TIMEOUT_CHECK(udata) jsExecTimeoutCheck(udata)
+
+/* Date.now() follows the virtual clock when it's on, see jsDateNow() in VirtualClock.cpp */
+#undef DUK_USE_DATE_GET_NOW
+extern duk_double_t jsDateNow(void *thr);
+#define DUK_USE_DATE_GET_NOW(ctx) jsDateNow((void *) (ctx))
+
+#endif  /* DUK_MIDIGYVER_H_INCLUDED */
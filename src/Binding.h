@@ -0,0 +1,412 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "yaml-cpp/yaml.h"
+
+#include "ops/osc.h"
+#include "ops/shapers.h"
+#include "Expression.h"
+#include "ops/target.h"
+#include "ops/strings.h"
+#include "types/Vector.h"
+#include "types/Color.h"
+
+enum DataType {
+    TYPE_UNKNOWN,
+
+    TYPE_BUTTON,
+    TYPE_TOGGLE,
+
+    TYPE_NUMBER,
+
+    TYPE_VECTOR,
+    TYPE_COLOR,
+
+    TYPE_STRING,
+
+    TYPE_MIDI_NOTE,
+    TYPE_MIDI_CONTROLLER_CHANGE,
+    TYPE_MIDI_TIMING_TICK
+};
+
+inline DataType toDataType(const std::string& _string ) {
+    std::string typeString = toLower(_string);
+
+    if (typeString == "button")
+        return TYPE_BUTTON;
+
+    else if (typeString == "toggle")
+        return TYPE_TOGGLE;
+
+    else if (   typeString == "state" ||
+                typeString == "enum" ||
+                typeString == "strings" )
+        return TYPE_STRING;
+
+    else if (   typeString == "scalar" ||
+                typeString == "number" ||
+                typeString == "float" ||
+                typeString == "int" )
+        return TYPE_NUMBER;
+
+    else if (   typeString == "vec2" ||
+                typeString == "vec3" ||
+                typeString == "vector" )
+        return TYPE_VECTOR;
+
+    else if (   typeString == "vec4" ||
+                typeString == "color" )
+        return TYPE_COLOR;
+
+    else if (   typeString == "note" ||
+                typeString == "note_on" )
+        return TYPE_MIDI_NOTE;
+
+    else if (   typeString == "cc" ||
+                typeString == "controller_change" )
+        return TYPE_MIDI_CONTROLLER_CHANGE;
+
+    else if (   typeString == "tick" ||
+                typeString == "timing_tick" )
+        return TYPE_MIDI_TIMING_TICK;
+
+    return TYPE_UNKNOWN;
+}
+
+// A message send by buttons and toggles when they turn on or off.
+// Ex: 'define,DRAW_SHAPE' or just 'DRAW_SHAPE' (in that case the prop is the binding name)
+struct BindingMessage {
+    bool        hasProp = false;
+    std::string prop;
+    std::string msg;
+};
+
+class Device;
+class MidiDevice;
+
+// Current values of a binding. They change with every event, so they live
+// on the thread that processes them instead of on the Binding
+struct BindingState {
+    float                       valueRaw = 0.0f;
+    bool                        hasValueRaw = false;
+    bool                        hasValue = false;
+    bool                        valueBool = false;
+    float                       valueNumber = 0.0f;
+    int                         valueInt = 0;
+    Vector                      valueVector;
+    Color                       valueColor;
+    std::string                 valueString;
+};
+
+// Everything the events need from a YAML node of the 'in' or 'pulse' lists,
+// parsed once when the config is loaded. Part of a Snapshot, so it's never
+// modified once built.
+struct Binding {
+    YAML::Node                  node;           // source node, only touched on save
+    YAML::Node                  data;           // copy of it for the 'data' object of the shape function
+    std::string                 source;         // the node as loaded, to tell what changed on reload
+    Device*                     device = nullptr;
+    size_t                      index = 0;      // position on Snapshot::bindings
+    size_t                      slot = 0;       // of its values and JS function, kept across reloads
+    uint64_t                    born = 0;       // generation of the snapshot that built it
+
+    DataType                    type = TYPE_NUMBER;
+    std::string                 name;
+    bool                        hasName = false;
+
+    size_t                      channel = 0;
+    bool                        hasChannel = false;
+    std::vector<size_t>         keys;
+    unsigned char               status = 0;     // only accept events with this status (0 for any)
+
+    int32_t                     shape = -1;     // shape function index, the slot (-1 for none)
+    std::string                 function;       // its source
+    std::vector<Shaper>         shapers;        // native shaping steps, run before the JS function
+    Expression                  expr;           // shape_expr, run after the native steps
+
+    // map
+    bool                        hasMap = false;
+    std::vector<float>          mapNumbers;
+    std::vector<Vector>         mapVectors;
+    std::vector<Color>          mapColors;
+    std::vector<std::string>    mapStrings;
+    std::vector<BindingMessage> mapOn;
+    std::vector<BindingMessage> mapOff;
+
+    // map pre-evaluated for every MIDI value (0~127)
+    std::vector<float>          lutNumbers;
+    std::vector<Vector>         lutVectors;
+    std::vector<Color>          lutColors;
+    std::vector<uint8_t>        lutStrings;
+
+    // out
+    std::vector<Target>         targets;
+    std::vector<OscTemplate>    oscTemplates;   // one per target (invalid if it's not OSC)
+    std::vector<MidiDevice*>    midiTargets;
+
+    // Values saved on the node
+    BindingState                initial;
+};
+
+#ifndef M_MIN
+#define M_MIN(_a, _b) ((_a)<(_b)?(_a):(_b))
+#endif
+
+#ifndef M_MAX
+#define M_MAX(_a, _b) ((_a)>(_b)?(_a):(_b))
+#endif
+
+const size_t LUT_SIZE = 128;
+
+// True when the value can be resolved with a LUT look up
+inline bool isLutIndex(float _value) {
+    return _value >= 0.0f && _value < float(LUT_SIZE) && _value == float(int(_value));
+}
+
+// Piecewise linear interpolation of a 0~127 value over the map
+inline float mapNumber(const Binding& _binding, float _value) {
+    float value = _value;
+
+    if ( _binding.hasMap ) {
+        value /= 127.0f;
+
+        if ( _binding.mapNumbers.size() > 1 ) {
+            float total = _binding.mapNumbers.size() - 1;
+
+            size_t i_low = M_MAX(value, 0.0f) * total;
+            i_low = M_MIN(i_low, size_t(total));
+            size_t i_high = M_MIN(i_low + 1, size_t(total));
+            float pct = (value * total) - (float)i_low;
+            value = lerp(   _binding.mapNumbers[i_low],
+                            _binding.mapNumbers[i_high],
+                            pct );
+        }
+    }
+
+    return value;
+}
+
+inline Vector mapVector(const Binding& _binding, float _value) {
+    float pct = _value / 127.0f;
+    Vector value = Vector(0.0, 0.0, 0.0);
+
+    if ( _binding.mapVectors.size() > 1 ) {
+        float total = _binding.mapVectors.size() - 1;
+
+        size_t i_low = M_MAX(pct, 0.0f) * total;
+        i_low = M_MIN(i_low, size_t(total));
+        size_t i_high = M_MIN(i_low + 1, size_t(total));
+
+        value = lerp(   _binding.mapVectors[i_low],
+                        _binding.mapVectors[i_high],
+                        (pct * total) - (float)i_low );
+    }
+
+    return value;
+}
+
+inline Color mapColor(const Binding& _binding, float _value) {
+    float pct = _value / 127.0f;
+    Color value = Color(0.0, 0.0, 0.0);
+
+    if ( _binding.mapColors.size() > 1 ) {
+        float total = _binding.mapColors.size() - 1;
+
+        size_t i_low = M_MAX(pct, 0.0f) * total;
+        i_low = M_MIN(i_low, size_t(total));
+        size_t i_high = M_MIN(i_low + 1, size_t(total));
+
+        value = lerp(   _binding.mapColors[i_low],
+                        _binding.mapColors[i_high],
+                        (pct * total) - (float)i_low );
+    }
+
+    return value;
+}
+
+// Index on mapStrings (the caller checks there is at least one)
+inline size_t mapString(const Binding& _binding, float _value) {
+    int value = (int)_value;
+    size_t total = _binding.mapStrings.size();
+
+    if (total == 1 || value <= 0)
+        return 0;
+    else if (value >= 127)
+        return total - 1;
+
+    return M_MIN(size_t((value / 127.0f) * total), total - 1);
+}
+
+// Pre-evaluate the map of a binding for all the values a MIDI message can have
+inline void buildLUT(Binding& _binding) {
+    if (_binding.type == TYPE_NUMBER && _binding.mapNumbers.size() > 1) {
+        _binding.lutNumbers.resize(LUT_SIZE);
+        for (size_t i = 0; i < LUT_SIZE; i++)
+            _binding.lutNumbers[i] = mapNumber(_binding, float(i));
+    }
+    else if (_binding.type == TYPE_VECTOR && _binding.mapVectors.size() > 1) {
+        _binding.lutVectors.resize(LUT_SIZE);
+        for (size_t i = 0; i < LUT_SIZE; i++)
+            _binding.lutVectors[i] = mapVector(_binding, float(i));
+    }
+    else if (_binding.type == TYPE_COLOR && _binding.mapColors.size() > 1) {
+        _binding.lutColors.resize(LUT_SIZE);
+        for (size_t i = 0; i < LUT_SIZE; i++)
+            _binding.lutColors[i] = mapColor(_binding, float(i));
+    }
+    else if (_binding.type == TYPE_STRING && _binding.mapStrings.size() > 0 && _binding.mapStrings.size() <= 256) {
+        _binding.lutStrings.resize(LUT_SIZE);
+        for (size_t i = 0; i < LUT_SIZE; i++)
+            _binding.lutStrings[i] = (uint8_t)mapString(_binding, float(i));
+    }
+}
+
+inline bool isOscTemplate(const Binding& _binding, size_t _target) {
+    return _target < _binding.oscTemplates.size() && _binding.oscTemplates[_target].isValid();
+}
+
+// Pre-encode the OSC messages of a binding for each of its OSC targets.
+// Bindings without a name build their address on each event, so they are skipped
+inline void buildOscTemplates(Binding& _binding) {
+    _binding.oscTemplates.clear();
+    _binding.oscTemplates.resize(_binding.targets.size());
+
+    if (!_binding.hasName)
+        return;
+
+    std::string typetag;
+    if (_binding.type == TYPE_NUMBER)
+        typetag = ",f";
+    else if (_binding.type == TYPE_VECTOR)
+        typetag = ",fff";
+    else if (_binding.type == TYPE_COLOR)
+        typetag = ",ffff";
+    else if (   _binding.type == TYPE_STRING ||
+                _binding.type == TYPE_BUTTON ||
+                _binding.type == TYPE_TOGGLE )
+        typetag = ",s";
+    else
+        return;
+
+    for (size_t t = 0; t < _binding.targets.size(); t++) {
+        const Target& target = _binding.targets[t];
+        if (target.protocol != OSC_PROTOCOL || target.sender == nullptr)
+            continue;
+
+        OscTemplate& tmpl = _binding.oscTemplates[t];
+        tmpl.header = oscHeader(target.folder + _binding.name, typetag);
+
+        // leave room for the arguments
+        if (tmpl.header.size() + 16 > OSC_BUFFER_SIZE) {
+            tmpl.header.clear();
+            continue;
+        }
+
+        if (_binding.type == TYPE_BUTTON || _binding.type == TYPE_TOGGLE) {
+            if (_binding.hasMap) {
+                for (size_t i = 0; i < _binding.mapOn.size(); i++) {
+                    const BindingMessage& m = _binding.mapOn[i];
+                    tmpl.on.push_back( oscPacket(target.folder + (m.hasProp ? m.prop : _binding.name), m.msg) );
+                }
+                for (size_t i = 0; i < _binding.mapOff.size(); i++) {
+                    const BindingMessage& m = _binding.mapOff[i];
+                    tmpl.off.push_back( oscPacket(target.folder + (m.hasProp ? m.prop : _binding.name), m.msg) );
+                }
+            }
+            else {
+                tmpl.on.push_back( oscPacket(target.folder + _binding.name, "on") );
+                tmpl.off.push_back( oscPacket(target.folder + _binding.name, "off") );
+            }
+        }
+    }
+}
+
+inline bool parseMessage(const YAML::Node& _node, BindingMessage& _message) {
+    if (!_node || !_node.IsScalar())
+        return false;
+
+    std::string value = _node.as<std::string>();
+    stringReplace(value, ',');
+    std::vector<std::string> el = split(value, ',', true);
+
+    if (el.size() == 1) {
+        _message.hasProp = false;
+        _message.msg = value;
+    }
+    else {
+        _message.hasProp = true;
+        _message.prop = el[0];
+        _message.msg = el[1];
+    }
+    return true;
+}
+
+inline std::vector<BindingMessage> parseMessages(const YAML::Node& _node) {
+    std::vector<BindingMessage> messages;
+    if (_node.IsSequence()) {
+        for (size_t i = 0; i < _node.size(); i++) {
+            BindingMessage m;
+            if (parseMessage(_node[i], m))
+                messages.push_back(m);
+        }
+    }
+    else {
+        BindingMessage m;
+        if (parseMessage(_node, m))
+            messages.push_back(m);
+    }
+    return messages;
+}
+
+// Read the saved value (if any) of a node
+inline void parseValue(const YAML::Node& _node, const Binding& _binding, BindingState& _state) {
+    if (_node["value_raw"].IsDefined() && YAML::convert<float>::decode(_node["value_raw"], _state.valueRaw))
+        _state.hasValueRaw = true;
+
+    YAML::Node value = _node["value"];
+    if (!value.IsDefined())
+        return;
+
+    if (_binding.type == TYPE_BUTTON || _binding.type == TYPE_TOGGLE)
+        _state.hasValue = YAML::convert<bool>::decode(value, _state.valueBool);
+    else if (_binding.type == TYPE_NUMBER)
+        _state.hasValue = YAML::convert<float>::decode(value, _state.valueNumber);
+    else if (_binding.type == TYPE_VECTOR)
+        _state.hasValue = YAML::convert<Vector>::decode(value, _state.valueVector);
+    else if (_binding.type == TYPE_COLOR)
+        _state.hasValue = YAML::convert<Color>::decode(value, _state.valueColor);
+    else if (_binding.type == TYPE_STRING)
+        _state.hasValue = YAML::convert<std::string>::decode(value, _state.valueString);
+    else if (   _binding.type == TYPE_MIDI_NOTE ||
+                _binding.type == TYPE_MIDI_CONTROLLER_CHANGE ||
+                _binding.type == TYPE_MIDI_TIMING_TICK )
+        _state.hasValue = YAML::convert<int>::decode(value, _state.valueInt);
+}
+
+// Write back the current values on the source node
+inline void storeValue(const Binding& _binding, const BindingState& _state) {
+    YAML::Node node = _binding.node;
+    if (_state.hasValueRaw)
+        node["value_raw"] = _state.valueRaw;
+
+    if (!_state.hasValue)
+        return;
+
+    if (_binding.type == TYPE_BUTTON || _binding.type == TYPE_TOGGLE)
+        node["value"] = _state.valueBool;
+    else if (_binding.type == TYPE_NUMBER)
+        node["value"] = _state.valueNumber;
+    else if (_binding.type == TYPE_VECTOR)
+        node["value"] = _state.valueVector;
+    else if (_binding.type == TYPE_COLOR)
+        node["value"] = _state.valueColor;
+    else if (_binding.type == TYPE_STRING)
+        node["value"] = _state.valueString;
+    else if (   _binding.type == TYPE_MIDI_NOTE ||
+                _binding.type == TYPE_MIDI_CONTROLLER_CHANGE ||
+                _binding.type == TYPE_MIDI_TIMING_TICK )
+        node["value"] = _state.valueInt;
+}
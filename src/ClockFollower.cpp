@@ -0,0 +1,134 @@
+#include "ClockFollower.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "MidiDevice.h"
+
+// Gains of the filter, critically damped (beta = alpha^2 / (2 - alpha))
+static const double ALPHA = 0.1;
+static const double BETA = ALPHA * ALPHA / (2.0 - ALPHA);
+
+// A tick this many periods away from the prediction restarts the filter
+static const double RESYNC = 3.0;
+
+// Without ticks for this many periods the clock is considered stopped
+static const double TIMEOUT = 4.0;
+
+ClockFollower::ClockFollower() :
+    beatsPerBar(4),
+    estimate(0.0),
+    period(0.0),
+    position(-1.0),
+    epoch(0),
+    running(false),
+    started(false) {
+}
+
+void ClockFollower::process(unsigned char _status, unsigned char _lsb, unsigned char _msb, uint64_t _time) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    switch (_status) {
+        case MidiDevice::TIMING_TICK:
+            tick(_time);
+            break;
+
+        // the first tick after START is the downbeat
+        case MidiDevice::START_SONG:
+            position = -1.0;
+            running = true;
+            started = true;
+            epoch++;
+            break;
+
+        case MidiDevice::CONTINUE_SONG:
+            running = true;
+            started = true;
+            break;
+
+        case MidiDevice::STOP_SONG:
+            running = false;
+            break;
+
+        // in sixteenths (6 ticks), the next tick plays it
+        case MidiDevice::SONG_POSITION:
+            position = double((_msb << 7) | _lsb) * 6.0 - 1.0;
+            epoch++;
+            break;
+    }
+}
+
+void ClockFollower::tick(uint64_t _time) {
+    double time = double(_time);
+    stats.ticks++;
+    position++;
+
+    if (period <= 0.0) {
+        // the second tick gives the first period
+        if (stats.ticks > 1)
+            period = time - estimate;
+        estimate = time;
+        started = false;
+        return;
+    }
+
+    double predicted = estimate + period;
+    double error = time - predicted;
+
+    // after a pause (or a jump in tempo) start over from this tick
+    if (started || std::fabs(error) > period * RESYNC) {
+        if (!started) {
+            double interval = time - estimate;
+            if (interval > 0.0 && interval < period * RESYNC)
+                period = interval;
+            stats.resyncs++;
+        }
+        estimate = time;
+        started = false;
+        return;
+    }
+
+    estimate = predicted + ALPHA * error;
+    period += BETA * error;
+
+    stats.jitterTotal += std::fabs(error);
+    stats.jitterMax = std::max(stats.jitterMax, std::fabs(error));
+}
+
+bool ClockFollower::isRunning(uint64_t _time) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return running && period > 0.0 && double(_time) < estimate + period * TIMEOUT;
+}
+
+double ClockFollower::getBpm() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (period <= 0.0)
+        return 0.0;
+    return 60000000.0 / (period * CLOCK_PPQN);
+}
+
+double ClockFollower::getPosition(uint64_t _time) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (period <= 0.0 || position < 0.0)
+        return std::max(position, 0.0);
+
+    // no further than the next tick that hasn't arrived yet
+    double ahead = (double(_time) - estimate) / period;
+    return position + std::min(std::max(ahead, 0.0), 1.0);
+}
+
+uint64_t ClockFollower::getTime(double _tick) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    double time = estimate + (_tick - position) * period;
+    return time > 0.0 ? uint64_t(time) : 0;
+}
+
+size_t ClockFollower::getEpoch() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return epoch;
+}
+
+ClockStats ClockFollower::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
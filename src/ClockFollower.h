@@ -0,0 +1,63 @@
+#pragma once
+
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+// MIDI clocks send 24 ticks per quarter note
+#define CLOCK_PPQN 24
+
+struct ClockStats {
+    size_t      ticks = 0;
+    size_t      resyncs = 0;        // ticks too far from the prediction to be filtered
+    double      jitterTotal = 0.0;  // microseconds between each tick and its prediction
+    double      jitterMax = 0.0;
+};
+
+// Follows the MIDI clock (TIMING_TICK, START, CONTINUE, STOP and
+// SONG_POSITION) of an input device. The tick times go through an alpha-beta
+// filter (a steady state Kalman filter on tick time and period), so the BPM
+// and the position in between ticks are smooth even when the ticks arrive
+// with the jitter of a USB cable.
+//
+// Positions are in ticks since START (24 per beat). Times are steady clock
+// microseconds, like MidiEvent::timestamp. Fed from the RtMidi callback and
+// read from the scheduler thread.
+//
+class ClockFollower {
+public:
+
+    ClockFollower();
+
+    void        process(unsigned char _status, unsigned char _lsb, unsigned char _msb, uint64_t _time);
+
+    // Running and still receiving ticks
+    bool        isRunning(uint64_t _time) const;
+    double      getBpm() const;
+
+    // Extrapolated from the last tick
+    double      getPosition(uint64_t _time) const;
+
+    // When the position will be (or was) _tick
+    uint64_t    getTime(double _tick) const;
+
+    // Changes when the position jumps (START or SONG_POSITION)
+    size_t      getEpoch() const;
+
+    // A copy taken under the lock
+    ClockStats  getStats() const;
+
+    size_t      beatsPerBar;
+
+protected:
+    void        tick(uint64_t _time);
+
+    mutable std::mutex  mutex;
+    ClockStats  stats;
+    double      estimate;       // filtered time of the last tick
+    double      period;         // filtered microseconds between ticks, 0 until there are two
+    double      position;       // of the last tick
+    size_t      epoch;
+    bool        running;
+    bool        started;        // no tick since START/CONTINUE yet
+};
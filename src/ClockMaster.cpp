@@ -0,0 +1,159 @@
+#include "ClockMaster.h"
+
+#include <iostream>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "MidiDevice.h"
+#include "ClockFollower.h"
+
+// Time the thread spins (instead of sleeping) before each tick
+#define CLOCK_SPIN std::chrono::microseconds(500)
+
+ClockMaster::ClockMaster() :
+    tickWhileStopped(true),
+    ticks(0),
+    overruns(0),
+    jitterTotal(0.0),
+    jitterMax(0.0),
+    running(false),
+    playing(false),
+    bpm(120.0),
+    pending(0),
+    position(0),
+    realtime(false) {
+}
+
+ClockMaster::~ClockMaster() {
+    close();
+}
+
+void ClockMaster::addOutput(MidiDevice* _device) {
+    if (std::find(outputs.begin(), outputs.end(), _device) == outputs.end())
+        outputs.push_back(_device);
+}
+
+bool ClockMaster::open(double _bpm) {
+    if (running || outputs.empty())
+        return false;
+
+    setBpm(_bpm);
+    running = true;
+    thread = std::thread(&ClockMaster::run, this);
+    return true;
+}
+
+void ClockMaster::close() {
+    if (!running)
+        return;
+
+    running = false;
+    thread.join();
+
+    // don't leave the devices playing
+    if (playing) {
+        send(MidiDevice::STOP_SONG);
+        playing = false;
+    }
+}
+
+void ClockMaster::sendStart() {
+    pending |= PENDING_START;
+}
+
+void ClockMaster::sendStop() {
+    pending |= PENDING_STOP;
+}
+
+void ClockMaster::sendContinue() {
+    pending |= PENDING_CONTINUE;
+}
+
+void ClockMaster::sendSongPosition(size_t _sixteenths) {
+    position = std::min(_sixteenths, size_t(0x3FFF));
+    pending |= PENDING_POSITION;
+}
+
+void ClockMaster::setBpm(double _bpm) {
+    if (_bpm > 0.0)
+        bpm = _bpm;
+}
+
+void ClockMaster::send(unsigned char _status) {
+    for (size_t i = 0; i < outputs.size(); i++)
+        outputs[i]->send(&_status, 1);
+}
+
+void ClockMaster::send(unsigned char _status, unsigned char _lsb, unsigned char _msb) {
+    unsigned char msg[3] = { _status, _lsb, _msb };
+    for (size_t i = 0; i < outputs.size(); i++)
+        outputs[i]->send(msg, 3);
+}
+
+void ClockMaster::run() {
+#ifndef _WIN32
+    // Half way into the real time range, above the audio threads of most systems
+    sched_param param;
+    param.sched_priority = (sched_get_priority_min(SCHED_FIFO) + sched_get_priority_max(SCHED_FIFO)) / 2;
+    realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+    if (!realtime)
+        std::cout << "Heads up: the MIDI clock runs without real time priority (no permission)" << std::endl;
+#endif
+
+    // on a single core spinning would only take the time from everyone else
+    std::chrono::steady_clock::duration spin = std::chrono::steady_clock::duration::zero();
+    if (std::thread::hardware_concurrency() > 1)
+        spin = CLOCK_SPIN;
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+
+    while (running) {
+        std::chrono::duration<double, std::micro> period(60000000.0 / (bpm.load() * CLOCK_PPQN));
+        deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+
+        // sleep most of the way, the timer can wake up late, then spin until the deadline
+        std::this_thread::sleep_until(deadline - spin);
+        while (std::chrono::steady_clock::now() < deadline)
+            ;
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double late = std::chrono::duration<double, std::micro>(now - deadline).count();
+
+        // transport right before the tick, so the tick after START is the downbeat
+        int todo = pending.exchange(0);
+        if (todo & PENDING_STOP) {
+            send(MidiDevice::STOP_SONG);
+            playing = false;
+        }
+        if (todo & PENDING_POSITION) {
+            size_t p = position;
+            send(MidiDevice::SONG_POSITION, p & 0x7F, (p >> 7) & 0x7F);
+        }
+        if (todo & PENDING_START) {
+            send(MidiDevice::START_SONG);
+            playing = true;
+        }
+        else if (todo & PENDING_CONTINUE) {
+            send(MidiDevice::CONTINUE_SONG);
+            playing = true;
+        }
+
+        if (playing || tickWhileStopped) {
+            send(MidiDevice::TIMING_TICK);
+            ticks.fetch_add(1, std::memory_order_relaxed);
+            jitterTotal.store(jitterTotal.load(std::memory_order_relaxed) + late, std::memory_order_relaxed);
+            if (late > jitterMax.load(std::memory_order_relaxed))
+                jitterMax.store(late, std::memory_order_relaxed);
+        }
+
+        // too late to catch up, start counting from now
+        if (late > period.count()) {
+            deadline = now;
+            overruns.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+class MidiDevice;
+
+// Sends a 24 ppqn MIDI clock (plus START, STOP, CONTINUE and SONG_POSITION)
+// to some MIDI outputs from its own thread, with real time priority when
+// the system allows it. Ticks go out on absolute deadlines of the steady
+// clock, transport messages are sent right before the next tick.
+//
+class ClockMaster {
+public:
+
+    ClockMaster();
+    virtual ~ClockMaster();
+
+    void        addOutput(MidiDevice* _device);
+
+    bool        open(double _bpm);
+    void        close();
+
+    // Queued for the next tick
+    void        sendStart();
+    void        sendStop();
+    void        sendContinue();
+    void        sendSongPosition(size_t _sixteenths);
+
+    void        setBpm(double _bpm);
+    double      getBpm() const { return bpm.load(); }
+    bool        isPlaying() const { return playing.load(); }
+    bool        isRealtime() const { return realtime; }
+
+    // Ticks are also sent while stopped, so devices can show the tempo
+    bool        tickWhileStopped;
+
+    // stats, only written by the clock thread
+    std::atomic<size_t> ticks;
+    std::atomic<size_t> overruns;       // deadlines missed by more than a tick
+    std::atomic<double> jitterTotal;    // microseconds between each deadline and its tick
+    std::atomic<double> jitterMax;
+
+protected:
+    void        run();
+    void        send(unsigned char _status);
+    void        send(unsigned char _status, unsigned char _lsb, unsigned char _msb);
+
+    enum Pending {
+        PENDING_START = 1,
+        PENDING_STOP = 2,
+        PENDING_CONTINUE = 4,
+        PENDING_POSITION = 8
+    };
+
+    std::vector<MidiDevice*>    outputs;
+
+    std::thread                 thread;
+    std::atomic<bool>           running;
+    std::atomic<bool>           playing;
+    std::atomic<double>         bpm;
+    std::atomic<int>            pending;
+    std::atomic<size_t>         position;   // in sixteenths, for SONG_POSITION
+    bool                        realtime;
+};
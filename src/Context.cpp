@@ -1,5 +1,9 @@
 #include "Context.h"
 
+#include <set>
+#include <cmath>
+#include <algorithm>
+
 #include "ops/broadcast.h"
 
 #include "ops/nodes.h"
@@ -8,70 +12,400 @@
 #include "types/Vector.h"
 #include "types/Color.h"
 
-#ifndef M_MIN
-#define M_MIN(_a, _b) ((_a)<(_b)?(_a):(_b))
-#endif
+#include "VirtualClock.h"
+
+// Key ranges are stored back as the list of keys
+static void setNodeKeys(YAML::Node _node, const std::vector<size_t>& _keys) {
+    // if it's only one 
+    if (_keys.size() == 1)
+        _node["key"] = _keys[0];
+
+    // If they are multiple keys
+    else if (_keys.size() > 1) {
+        _node.remove("key");
+        for (size_t j = 0; j < _keys.size(); j++)
+            _node["key"].push_back(_keys[j]);
+    }
+}
+
+// Senders are shared by all the targets of the same protocol and host:port
+std::string senderKey(const Target& _target) {
+    return (_target.protocol == OSC_PROTOCOL ? "osc://" : "udp://") + Sender::getKey(_target.address, _target.port);
+}
 
-Context::Context() : safe(false) {
+Context::Context() : 
+    queueSize(256),
+    queuePolicy(QUEUE_DROP_OLDEST),
+    clockBeats(4),
+    clockMaster(nullptr),
+    oscBundle(true),
+    oscMtu(SENDER_MTU),
+    outputAsync(true),
+    outputSize(256),
+    outputPolicy(SEND_LATEST),
+    csvBufferSize(64 * 1024),
+    csvInterval(250),
+    csvTimestamps(false),
+    safe(false),
+    reloading(false),
+    snapshot(nullptr),
+    building(nullptr),
+    generations(0),
+    reuseBindings(false),
+    keepGlobal(false),
+    slots(0),
+    midiPortsListed(false),
+    active(nullptr),
+    activeGeneration(0),
+    jsGcIdle(true),
+    jsGcInterval(1000),
+    routesResolved(0),
+    shapeStatus(0),
+    dispatchPending(false),
+    dispatching(false),
+    tasksPending(false),
+    dispatchAlive(false),
+    lastEvent(0),
+    lastGcAllocs(0) {
+
+    js.userData = this;
+    js.addNativeFunction("emit", jsEmit, DUK_VARARGS);
+    js.addNativeFunction("feedback", jsFeedback, 4);
+    js.addNativeFunction("send", jsSend, 2);
+    js.addNativeFunction("clock", jsClock, 1);
+    js.addNativeFunction("transport", jsTransport, 2);
 }
 
 Context::~Context() {
+    stopDispatch();
 }
 
-DataType toDataType(const std::string& _string ) {
-    std::string typeString = toLower(_string);
+bool Context::load(const std::string& _filename) {
+    std::lock_guard<std::recursive_mutex> lock(buildMutex);
+    config = YAML::LoadFile(_filename);
 
-    if (typeString == "button")
-        return TYPE_BUTTON;
+    build();
+    publish();
+    startPulses();
 
-    else if (typeString == "toggle")
-        return TYPE_TOGGLE;
+    // the virtual clock runs everything from simulate()
+    if (!VirtualClock::isEnabled())
+        startDispatch();
 
-    else if (   typeString == "state" ||
-                typeString == "enum" ||
-                typeString == "strings" )
-        return TYPE_STRING;
+    return safe;
+}
 
-    else if (   typeString == "scalar" ||
-                typeString == "number" ||
-                typeString == "float" ||
-                typeString == "int" )
-        return TYPE_NUMBER;
-        
-    else if (   typeString == "vec2" ||
-                typeString == "vec3" ||
-                typeString == "vector" )
-        return TYPE_VECTOR;
+static bool sameNode(const YAML::Node& _a, const YAML::Node& _b) {
+    return YAML::Dump(_a) == YAML::Dump(_b);
+}
+
+// What an event is looked up by: the device, and the channel, keys or status
+// of the node. A reload matches the bindings by it, not by their position
+static std::string bindingId(YAML::Node _node, Device* _device) {
+    std::ostringstream id;
+    id << (void*)_device;
+    const char* fields[] = { "channel", "key", "status" };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        id << '|';
+        if (_node[fields[i]].IsDefined())
+            id << YAML::Dump(_node[fields[i]]);
+    }
+    return id.str();
+}
+
+// The pulse of '_pulses' with that name, or an undefined node
+static YAML::Node findPulse(const YAML::Node& _pulses, const std::string& _name) {
+    if (_pulses.IsSequence())
+        for (size_t i = 0; i < _pulses.size(); i++)
+            if (_pulses[i]["name"].IsDefined() && _pulses[i]["name"].as<std::string>() == _name)
+                return _pulses[i];
+    return YAML::Node(YAML::NodeType::Undefined);
+}
+
+bool Context::reload(const std::string& _filename) {
+    std::lock_guard<std::recursive_mutex> lock(buildMutex);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // a file that doesn't parse leaves everything as it was
+    YAML::Node newConfig;
+    try {
+        newConfig = YAML::LoadFile(_filename);
+    }
+    catch (YAML::Exception& e) {
+        std::cout << "Can't reload " << _filename << ": " << e.what() << std::endl;
+        return false;
+    }
 
-    else if (   typeString == "vec4" ||
-                typeString == "color" )
-        return TYPE_COLOR;
+    // Settings everything depends on need to build it all again
+    const char* shared[] = { "queue", "osc", "output", "csv", "clock" };
+    bool full = !safe;
+    for (size_t i = 0; i < sizeof(shared) / sizeof(shared[0]); i++)
+        full = full || !sameNode(config[shared[i]], newConfig[shared[i]]);
+
+    // the clock master can be using devices of 'out'
+    full = full || (clockMaster && !sameNode(config["out"], newConfig["out"]));
+
+    if (full) {
+        close();
+        load(_filename);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Reloaded " << _filename << " in " << ms << "ms (everything)" << std::endl;
+        return safe;
+    }
+
+    reloadStats = ReloadStats();
+    size_t outputs = senders.size() + writers.size();
+
+    // bindings inherit the default 'out' and the JS settings
+    reuseBindings = sameNode(config["out"], newConfig["out"]) && sameNode(config["js"], newConfig["js"]);
+
+    // what shape functions stored on 'global' survives, unless it's redefined
+    keepGlobal = sameNode(config["global"], newConfig["global"]);
+    reloadStats.globalReset = !keepGlobal;
+
+    // Events keep going through the last snapshot while the new one is
+    // built, the MIDI callbacks queue them all meanwhile (see MidiDevice)
+    reloading = true;
+
+    // Pulses that keep their timing keep running, the rest stop now
+    std::vector<Pulse*> stopped;
+    for (std::map<std::string, Device*>::iterator it = listenDevices.begin(); it != listenDevices.end(); it++) {
+        if (it->second->type == DEVICE_PULSE) {
+            Pulse* p = (Pulse*)it->second;
+            YAML::Node a = findPulse(config["pulse"], it->first);
+            YAML::Node b = findPulse(newConfig["pulse"], it->first);
+
+            bool same = p->isRunning() && b.IsDefined();
+            const char* timing[] = { "bpm", "fps", "interval", "sync", "division" };
+            for (size_t i = 0; i < sizeof(timing) / sizeof(timing[0]) && same; i++)
+                same = sameNode(a[timing[i]], b[timing[i]]);
+
+            if (same)
+                sparePulses[it->first] = p;
+            else {
+                p->stop();
+                stopped.push_back(p);
+            }
+        }
+        else
+            spareInputs[it->first] = (MidiDevice*)it->second;
+    }
 
-    else if (   typeString == "note" || 
-                typeString == "note_on" )
-        return TYPE_MIDI_NOTE;
+    for (std::map<std::string, Device*>::iterator it = targetsDevices.begin(); it != targetsDevices.end(); it++)
+        spareOutputs[it->first] = (MidiDevice*)it->second;
 
-    else if (   typeString == "cc" ||
-                typeString == "controller_change" )
-        return TYPE_MIDI_CONTROLLER_CHANGE;
+    // a copy, the dispatch thread is still going through them
+    spareBindings = snapshot.load(std::memory_order_acquire)->bindings;
+    spareBindingsTaken.assign(spareBindings.size(), false);
+    spareBindingIds.clear();
+    for (size_t i = 0; i < spareBindings.size(); i++)
+        spareBindingIds[bindingId(spareBindings[i].node, spareBindings[i].device)].push_back(i);
+    listenDevices.clear();
+    listenDevicesNames.clear();
+    inputDevices.clear();
+    targets.clear();
+    targetsDevices.clear();
+    targetsDevicesNames.clear();
 
-    else if (   typeString == "tick" ||
-                typeString == "timing_tick" )
-        return TYPE_MIDI_TIMING_TICK;
+    config = newConfig;
+    build(true);
+
+    // the slots of what wasn't kept can be taken again
+    for (size_t i = 0; i < spareBindings.size(); i++)
+        if (!spareBindingsTaken[i])
+            freeSlots.push_back(spareBindings[i].slot);
+
+    spareBindings.clear();
+    spareBindingsTaken.clear();
+    spareBindingIds.clear();
+    reuseBindings = false;
+    keepGlobal = false;
+
+    // sockets and csv files nobody sends to anymore
+    std::set<void*> used;
+    for (size_t i = 0; i < targets.size(); i++) {
+        used.insert(targets[i].sender);
+        used.insert(targets[i].writer);
+    }
+    for (size_t b = 0; b < building->bindings.size(); b++) {
+        for (size_t i = 0; i < building->bindings[b].targets.size(); i++) {
+            used.insert(building->bindings[b].targets[i].sender);
+            used.insert(building->bindings[b].targets[i].writer);
+        }
+    }
 
-    return TYPE_UNKNOWN;
+    size_t opened = senders.size() + writers.size() - outputs;
+    std::vector<Sender*> unusedSenders;
+    for (std::map<std::string, Sender*>::iterator it = senders.begin(); it != senders.end();) {
+        if (used.count(it->second) == 0) {
+            unusedSenders.push_back(it->second);
+            it = senders.erase(it);
+        }
+        else
+            it++;
+    }
+    std::vector<FileWriter*> unusedWriters;
+    for (std::map<std::string, FileWriter*>::iterator it = writers.begin(); it != writers.end();) {
+        if (used.count(it->second) == 0) {
+            unusedWriters.push_back(it->second);
+            it = writers.erase(it);
+        }
+        else
+            it++;
+    }
+    reloadStats.outputsOpened = opened;
+    reloadStats.outputsKept = senders.size() + writers.size() - opened;
+    reloadStats.outputsClosed = unusedSenders.size() + unusedWriters.size();
+
+    publish();
+    reloading = false;
+
+    startPulses();
+
+    // What wasn't taken again goes away, once the dispatch thread is done
+    // with the last snapshot
+    for (size_t i = 0; i < stopped.size(); i++)
+        Epoch::retire(stopped[i], [](void* _pulse) { delete (Pulse*)_pulse; });
+    for (std::map<std::string, Pulse*>::iterator it = sparePulses.begin(); it != sparePulses.end(); it++) {
+        it->second->stop();
+        Epoch::retire(it->second, [](void* _pulse) { delete (Pulse*)_pulse; });
+    }
+    reloadStats.pulsesStopped = stopped.size() + sparePulses.size();
+    sparePulses.clear();
+
+    reloadStats.portsClosed = spareInputs.size() + spareOutputs.size();
+    for (std::map<std::string, MidiDevice*>::iterator it = spareInputs.begin(); it != spareInputs.end(); it++)
+        Epoch::retire(it->second, [](void* _device) { delete (MidiDevice*)_device; });
+    for (std::map<std::string, MidiDevice*>::iterator it = spareOutputs.begin(); it != spareOutputs.end(); it++)
+        Epoch::retire(it->second, [](void* _device) { delete (MidiDevice*)_device; });
+    spareInputs.clear();
+    spareOutputs.clear();
+    reloadStats.portsOpened = inputDevices.size() + targetsDevices.size() - reloadStats.portsKept;
+
+    for (size_t i = 0; i < unusedSenders.size(); i++)
+        Epoch::retire(unusedSenders[i], [](void* _sender) { delete (Sender*)_sender; });
+    for (size_t i = 0; i < unusedWriters.size(); i++)
+        Epoch::retire(unusedWriters[i], [](void* _writer) { delete (FileWriter*)_writer; });
+
+    const ReloadStats& r = reloadStats;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Reloaded " << _filename << " in " << ms << "ms: "
+                << r.bindingsBuilt << " bindings rebuilt, " << r.bindingsKept << " kept; "
+                << "MIDI ports " << r.portsOpened << " opened, " << r.portsKept << " kept, " << r.portsClosed << " closed; "
+                << "pulses " << r.pulsesStarted << " started, " << r.pulsesKept - r.pulsesRestarted << " kept running, " << r.pulsesStopped << " stopped; "
+                << "sockets/files " << r.outputsOpened << " opened, " << r.outputsKept << " kept, " << r.outputsClosed << " closed; "
+                << "global " << (r.globalReset ? "reset" : "kept") << std::endl;
+    return safe;
 }
 
+// Sets everything up from 'config', taking what it can from the spare
+// devices, pulses and bindings of the previous one (see reload)
+bool Context::build(bool _reload) {
+    const Snapshot* last = snapshot.load(std::memory_order_acquire);
+    building = new Snapshot();
+    building->generation = ++generations;
+    building->config = config;
+
+    // Shape functions that declare arguments get the event values through them,
+    // unless the old device/status/channel/key/value/data globals are forced
+    if (config["js"].IsMap() && config["js"]["globals"].IsDefined())
+        building->jsGlobals = config["js"]["globals"].as<bool>();
+
+    // Compiled functions are cached on disk, by default on ~/.cache/midigyver
+    std::string& jsCache = building->jsCache;
+    if (getenv("HOME"))
+        jsCache = std::string(getenv("HOME")) + "/.cache/midigyver/";
+    if (config["js"].IsMap() && config["js"]["cache"].IsDefined()) {
+        std::string cache = config["js"]["cache"].as<std::string>();
+        if (cache == "false" || cache == "off")
+            jsCache.clear();
+        else if (cache.compare(0, 2, "~/") == 0 && getenv("HOME"))
+            jsCache = std::string(getenv("HOME")) + cache.substr(1);
+        else
+            jsCache = cache;
+    }
 
-bool Context::load(const std::string& _filename) {
-    config = YAML::LoadFile(_filename);
+    // Time budget of each call to a shape function, in milliseconds
+    if (config["js"].IsMap()) {
+        if (config["js"]["timeout"].IsDefined())
+            building->jsTimeout = config["js"]["timeout"].as<float>();
+        if (config["js"]["strikes"].IsDefined())
+            building->jsStrikes = config["js"]["strikes"].as<size_t>();
+    }
 
-    // JS Globals
-    JSValue global = parseNode(js, config["global"]);
-    js.setGlobalValue("global", std::move(global));
+    // Mark-and-sweep while no events are coming, at most every 'gc_interval' ms
+    if (config["js"].IsMap()) {
+        if (config["js"]["gc"].IsDefined())
+            building->jsGcIdle = config["js"]["gc"].as<std::string>() == "idle";
+        if (config["js"]["gc_interval"].IsDefined())
+            building->jsGcInterval = config["js"]["gc_interval"].as<size_t>();
+    }
 
-    // Load MidiDevices
-    std::vector<std::string> availableMidiOutPorts = MidiDevice::getOutPorts();
+    // JS Globals, set again only if they changed (see install)
+    building->global = YAML::Clone(config["global"]);
+    building->globalBorn = keepGlobal && last ? last->globalBorn : building->generation;
+
+    // Event queue between the MIDI callbacks and the dispatch thread
+    queueSize = 256;
+    queuePolicy = QUEUE_DROP_OLDEST;
+    if (config["queue"].IsMap()) {
+        if (config["queue"]["size"].IsDefined())
+            queueSize = config["queue"]["size"].as<size_t>();
+        if (config["queue"]["overflow"].IsDefined())
+            queuePolicy = toQueuePolicy( toLower(config["queue"]["overflow"].as<std::string>()) );
+    }
+
+    // OSC messages of the same event are grouped in bundles of at most 'mtu' bytes
+    oscBundle = true;
+    oscMtu = SENDER_MTU;
+    if (config["osc"].IsMap()) {
+        if (config["osc"]["bundle"].IsDefined())
+            oscBundle = config["osc"]["bundle"].as<bool>();
+        if (config["osc"]["mtu"].IsDefined())
+            oscMtu = config["osc"]["mtu"].as<size_t>();
+    }
+
+    // OSC/UDP targets are sent from a thread each, through a bounded queue
+    outputAsync = true;
+    outputSize = 256;
+    outputPolicy = SEND_LATEST;
+    outputPolicies.clear();
+    if (config["output"].IsMap()) {
+        if (config["output"]["async"].IsDefined())
+            outputAsync = config["output"]["async"].as<bool>();
+        if (config["output"]["size"].IsDefined())
+            outputSize = config["output"]["size"].as<size_t>();
+        if (config["output"]["overflow"].IsDefined())
+            outputPolicy = toSendPolicy( toLower(config["output"]["overflow"].as<std::string>()) );
+
+        // per target overflow policy
+        if (config["output"]["targets"].IsMap()) {
+            for (YAML::const_iterator it = config["output"]["targets"].begin(); it != config["output"]["targets"].end(); ++it) {
+                Target target = parseTarget( it->first.as<std::string>() );
+                outputPolicies[ senderKey(target) ] = toSendPolicy( toLower(it->second.as<std::string>()) );
+            }
+        }
+    }
+
+    // with the virtual clock everything happens in order, on the main thread
+    if (VirtualClock::isEnabled())
+        outputAsync = false;
+
+    // csv files are written from a background thread
+    csvBufferSize = 64 * 1024;
+    csvInterval = 250;
+    csvTimestamps = false;
+    if (config["csv"].IsMap()) {
+        if (config["csv"]["buffer"].IsDefined())
+            csvBufferSize = config["csv"]["buffer"].as<size_t>();
+        if (config["csv"]["interval"].IsDefined())
+            csvInterval = config["csv"]["interval"].as<size_t>();
+        if (config["csv"]["timestamps"].IsDefined())
+            csvTimestamps = config["csv"]["timestamps"].as<bool>();
+    }
+
+    // MIDI ports are only listed if something new has to be opened
+    midiPortsListed = false;
 
     // Define out targets
     if (config["out"].IsSequence()) {
@@ -80,13 +414,19 @@ bool Context::load(const std::string& _filename) {
             Target target = parseTarget( name );
 
             if (target.protocol == MIDI_PROTOCOL) {
-                MidiDevice* m = new MidiDevice(this, name);
-
-                int deviceID = getMatchingKey(availableMidiOutPorts, target.address);
-                if (deviceID >= 0)
-                    m->openOutPort(target.address, deviceID);
-                else
-                    m->openVirtualOutPort(target.address);
+                MidiDevice* m = takeSpareOutput(target.address);
+                if (m == nullptr) {
+                    m = new MidiDevice(this, name);
+
+                    // with the virtual clock what's sent is recorded instead
+                    if (!VirtualClock::isEnabled()) {
+                        int deviceID = getMatchingKey(getMidiOutPorts(), target.address);
+                        if (deviceID >= 0)
+                            m->openOutPort(target.address, deviceID);
+                        else
+                            m->openVirtualOutPort(target.address);
+                    }
+                }
 
                 m->defaultOutChannel = toInt(target.port);
 
@@ -96,103 +436,106 @@ bool Context::load(const std::string& _filename) {
                 targetsDevicesNames.push_back( target.address );
                 targetsDevices[target.address] = (Device*)m;
             }
+            else if (target.protocol == OSC_PROTOCOL || target.protocol == UDP_PROTOCOL)
+                target.sender = getSender(target);
+            else if (target.protocol == CSV_PROTOCOL && target.isFile && !VirtualClock::isEnabled())
+                target.writer = getWriter(target);
             
             targets.push_back(target);
         }
     }
 
-    // JS Functions
-    uint32_t id = 0;
-    
-    // Load MidiDevices
-    std::vector<std::string> availableMidiInPorts = MidiDevice::getInPorts();
+    // Beats per bar of the MIDI clocks
+    clockBeats = 4;
+    if (config["clock"].IsMap() && config["clock"]["beats"].IsDefined())
+        clockBeats = config["clock"]["beats"].as<size_t>();
+
+    // Clock master for the MIDI outputs on clock/out (kept as it is on reload)
+    if (config["clock"].IsMap() && config["clock"]["out"].IsDefined()) {
+        YAML::Node out = config["clock"]["out"];
+        bool kept = clockMaster != nullptr;
+        ClockMaster* master = kept ? clockMaster : new ClockMaster();
 
+        for (size_t i = 0; i < (out.IsSequence() ? out.size() : 1); i++) {
+            std::string pattern = out.IsSequence() ? out[i].as<std::string>() : out.as<std::string>();
+            master->addOutput( getClockOutDevice(pattern) );
+        }
+
+        if (!kept) {
+            if (config["clock"]["stopped_ticks"].IsDefined())
+                master->tickWhileStopped = config["clock"]["stopped_ticks"].as<bool>();
+
+            double bpm = config["clock"]["bpm"].IsDefined() ? config["clock"]["bpm"].as<double>() : 120.0;
+            if (VirtualClock::isEnabled())
+                std::cout << "Heads up: the MIDI clock out doesn't run with the virtual clock" << std::endl;
+            else
+                master->open(bpm);
+
+            if (config["clock"]["start"].IsDefined() && config["clock"]["start"].as<bool>())
+                master->sendStart();
+
+            // transport() reaches it from the dispatch thread
+            std::lock_guard<std::mutex> lock(clockMutex);
+            clockMaster = master;
+        }
+    }
+
+    // Load MidiDevices
     if (config["in"].IsMap()) {
         for (YAML::const_iterator dev = config["in"].begin(); dev != config["in"].end(); ++dev) {
             std::string inName = dev->first.as<std::string>();
-            int deviceID = getMatchingKey(availableMidiInPorts, inName);
-
-            if (deviceID >= 0) {
-                MidiDevice* m = new MidiDevice(this, inName, deviceID);
-                listenDevicesNames.push_back(inName);
-                listenDevices[inName] = (Device*)m;
-
-                for (size_t i = 0; i < config["in"][inName].size(); i++) {
-
-                    // ADD KEY EVENT
-                    if (config["in"][inName][i]["key"].IsDefined()) {
-
-                        size_t channel = 0;
-                        if (config["in"][inName][i]["channel"].IsDefined())
-                            channel = config["in"][inName][i]["channel"].as<int>();
-                        
-                        bool haveShapingFunction = false;
-                        if (config["in"][inName][i]["shape"].IsDefined()) {
-                            std::string function = config["in"][inName][i]["shape"].as<std::string>();
-                            if ( js.setFunction(id, function) ) {
-                                haveShapingFunction = true;
-                            }
-                        }
-
-                        // Get matching key/s
-                        std::vector<size_t> keys = getArrayOfKeys(config["in"][inName][i]["key"]);
-
-                        // if it's only one 
-                        if (keys.size() == 1) {
-                            size_t key = keys[0];
-                            config["in"][inName][i]["key"] = key;
-                            listenDevices[inName]->setKeyFnc(channel, key, i);
-                                if (haveShapingFunction)
-                                    shapeFncs[inName + "_" + toString(channel) + "_" + toString(key)] = id;
-                        }
-                        // If they are multiple keys
-                        else if (keys.size() > 1) {
-                            config["in"][inName][i].remove("key");
-                            for (size_t j = 0; j < keys.size(); j++) {
-                                config["in"][inName][i]["key"].push_back(keys[j]);
-                                listenDevices[inName]->setKeyFnc(channel, keys[j], i);
-                                if (haveShapingFunction)
-                                    shapeFncs[inName + "_" + toString(channel) + "_" + toString(keys[j])] = id;
-                            }
-                        }
-
-                        if (haveShapingFunction)
-                            id++;
-                    }
 
-                    // ADD STATUS ONLY EVENT
-                    else if (config["in"][inName][i]["status"].IsDefined()) {
-
-                        std::string status_str = config["in"][inName][i]["status"].as<std::string>();
-                        status_str = toUpper(status_str);
-                        unsigned char status = MidiDevice::statusNameToByte(status_str);
-
-                        if (status == MidiDevice::TIMING_TICK ||
-                            status == MidiDevice::START_SONG ||
-                            status == MidiDevice::CONTINUE_SONG ||
-                            status == MidiDevice::STOP_SONG ) {
-
-                            listenDevices[inName]->setStatusFnc(status, i);
-                            if (config["in"][inName][i]["shape"].IsDefined()) {
-                                std::string function = config["in"][inName][i]["shape"].as<std::string>();
-                                if ( js.setFunction(id, function) ) {
-                                    shapeFncs[inName + "_" + status_str] = id;
-                                    id++;
-                                }
-                            }
-                        }
-                    }
+            // with the virtual clock the events are replayed, nothing is opened
+            MidiDevice* m = takeSpareInput(inName);
+            if (m == nullptr && VirtualClock::isEnabled()) {
+                m = new MidiDevice(this, inName);
+                m->queue.allocate(queueSize, queuePolicy);
+            }
+            else if (m == nullptr) {
+                int deviceID = getMatchingKey(getMidiInPorts(), inName);
+                if (deviceID < 0)
+                    continue;
+                m = new MidiDevice(this, inName, deviceID);
+            }
+
+            m->clock.beatsPerBar = clockBeats;
+            m->id.store(inputDevices.size(), std::memory_order_relaxed);
+            inputDevices.push_back(m);
+            listenDevicesNames.push_back(inName);
+            listenDevices[inName] = (Device*)m;
+
+            for (size_t i = 0; i < config["in"][inName].size(); i++) {
+                YAML::Node node = config["in"][inName][i];
+
+                // ADD KEY EVENT
+                if (node["key"].IsDefined()) {
+                    size_t b = addBinding(node, m);
+                    const Binding& binding = building->bindings[b];
+                    for (size_t j = 0; j < binding.keys.size(); j++)
+                        m->setKeyFnc(binding.channel, binding.keys[j], b);
                 }
 
-                updateDevice(inName);
+                // ADD STATUS ONLY EVENT
+                else if (node["status"].IsDefined()) {
+                    unsigned char status = MidiDevice::statusNameToByte( toUpper(node["status"].as<std::string>()) );
+
+                    if (status == MidiDevice::TIMING_TICK ||
+                        status == MidiDevice::START_SONG ||
+                        status == MidiDevice::CONTINUE_SONG ||
+                        status == MidiDevice::STOP_SONG ) {
+
+                        size_t b = addBinding(node, m);
+                        m->setStatusFnc(status, b);
+                    }
+                }
             }
         }
     }
 
-    if (listenDevices.size() == 0) {
+    if (listenDevices.size() == 0 && !_reload) {
         std::cout << "Heads up: MidiGyver is not listening to any of the available MIDI devices: " << std::endl;
-        for (size_t i = 0; i < availableMidiInPorts.size(); i++)
-            std::cout << "  - " << availableMidiInPorts[i] << std::endl;
+        for (size_t i = 0; i < getMidiInPorts().size(); i++)
+            std::cout << "  - " << getMidiInPorts()[i] << std::endl;
     }
 
     // Load Pulses
@@ -201,683 +544,1653 @@ bool Context::load(const std::string& _filename) {
             YAML::Node n = config["pulse"][i];
             std::string name = n["name"].as<std::string>();
 
-            Pulse* p = new Pulse(this, i);
-            
+            // a pulse with the same timing keeps running through a reload
+            Pulse* p = takeSparePulse(name);
+            bool kept = p != nullptr;
+            if (!kept)
+                p = new Pulse(this, name);
+
             if (n["channel"].IsDefined())
                 p->defaultOutChannel = n["channel"].as<int>();
 
-            if (n["bpm"].IsDefined())
-                p->start(30000/n["bpm"].as<int>());
+            size_t b = addBinding(n, p);
+            p->setStatusFnc(MidiDevice::TIMING_TICK, b);
+
+            listenDevicesNames.push_back(name);
+            listenDevices[name] = (Device*)p;
+
+            // follow the MIDI clock of an input, or run on their own (they
+            // start after, see startPulses)
+            PulseStart start = { p, 0.0, nullptr, 1.0 };
+            if (n["sync"].IsDefined()) {
+                MidiDevice* clock = getClockDevice(n["sync"].as<std::string>());
+                if (clock) {
+                    start.clock = &clock->clock;
+                    start.division = n["division"].IsDefined() ? n["division"].as<double>() : 1.0;
+                }
+                else
+                    std::cout << "Pulse " << name << " can't find a MIDI input matching " << n["sync"].as<std::string>() << " to sync with" << std::endl;
+            }
+            // periods in microseconds, 'interval' is in milliseconds
+            else if (n["bpm"].IsDefined())
+                start.period = 30000000.0 / n["bpm"].as<double>();
             else if (n["fps"].IsDefined()) 
-                p->start(1000/int(n["fps"].as<float>()) );
+                start.period = 1000000.0 / n["fps"].as<double>();
             else if (n["interval"].IsDefined()) 
-                p->start(int(n["interval"].as<float>()));
+                start.period = n["interval"].as<double>() * 1000.0;
 
-            if (n["shape"].IsDefined()) {
-                std::string function = n["shape"].as<std::string>();
-                if ( js.setFunction(id, function) ) {
-                    shapeFncs[name + "_TIMING_TICK"] = id;
-                    id++;
-                }
+            // a kept pulse only restarts if its clock is now another input's
+            if (!kept || start.clock != p->getClock()) {
+                pulseStarts.push_back(start);
+                if (kept)
+                    reloadStats.pulsesRestarted++;
             }
+        }
+    }
 
-            listenDevicesNames.push_back(name);
-            listenDevices[name] = (Device*)p;
+    // Where the dispatch thread takes the events from, with the bindings
+    // they have on this snapshot (MIDI inputs first, then the pulses)
+    for (size_t d = 0; d < inputDevices.size(); d++) {
+        Source source = { inputDevices[d], inputDevices[d]->getFncs() };
+        building->sources.push_back(source);
+    }
+    for (size_t d = 0; d < listenDevicesNames.size(); d++) {
+        Device* device = listenDevices[ listenDevicesNames[d] ];
+        if (device->type == DEVICE_PULSE) {
+            Source source = { device, device->getFncs() };
+            building->sources.push_back(source);
         }
     }
 
+    buildRoutes();
+
     safe = true;
     return safe;
 }
 
+// Makes what build() filled the snapshot the events go through. The one it
+// replaces is freed once the dispatch thread moved on from it
+void Context::publish() {
+    building->senders = senders;
+    building->writers = writers;
+    building->slots = slots;
+
+    Snapshot* last = snapshot.exchange(building, std::memory_order_acq_rel);
+    building = nullptr;
+
+    // the binding tables the MIDI callbacks filter with
+    for (std::map<std::string, Device*>::iterator it = listenDevices.begin(); it != listenDevices.end(); it++)
+        it->second->publishFncs();
+
+    Epoch::retire(last, [](void* _snapshot) { delete (Snapshot*)_snapshot; });
+    notifyDispatch();
+}
+
+// An output for the clock master, opened only for it if it isn't on 'out'
+MidiDevice* Context::getClockOutDevice(const std::string& _pattern) {
+    for (size_t j = 0; j < targetsDevicesNames.size(); j++)
+        if (targetsDevicesNames[j] == _pattern || match(_pattern.c_str(), targetsDevicesNames[j].c_str()))
+            return (MidiDevice*)targetsDevices[ targetsDevicesNames[j] ];
+
+    MidiDevice* m = takeSpareOutput(_pattern);
+    if (m == nullptr) {
+        m = new MidiDevice(this, _pattern);
+        if (!VirtualClock::isEnabled()) {
+            int deviceID = getMatchingKey(getMidiOutPorts(), _pattern);
+            if (deviceID >= 0)
+                m->openOutPort(_pattern, deviceID);
+            else
+                m->openVirtualOutPort(_pattern);
+        }
+    }
+
+    targetsDevicesNames.push_back(_pattern);
+    targetsDevices[_pattern] = (Device*)m;
+    return m;
+}
+
+// The input a pulse follows, opened only for its clock if it isn't on 'in'
+MidiDevice* Context::getClockDevice(const std::string& _pattern) {
+    for (size_t d = 0; d < inputDevices.size(); d++)
+        if (inputDevices[d]->name == _pattern || match(_pattern.c_str(), inputDevices[d]->name.c_str()))
+            return inputDevices[d];
+
+    MidiDevice* m = takeSpareInput(_pattern);
+    if (m == nullptr && VirtualClock::isEnabled()) {
+        m = new MidiDevice(this, _pattern);
+        m->queue.allocate(queueSize, queuePolicy);
+    }
+    else if (m == nullptr) {
+        int deviceID = getMatchingKey(getMidiInPorts(), _pattern);
+        if (deviceID < 0)
+            return nullptr;
+        m = new MidiDevice(this, _pattern, deviceID);
+    }
+
+    m->clock.beatsPerBar = clockBeats;
+    m->id.store(inputDevices.size(), std::memory_order_relaxed);
+    inputDevices.push_back(m);
+    listenDevicesNames.push_back(_pattern);
+    listenDevices[_pattern] = (Device*)m;
+    return m;
+}
+
+// The MIDI ports of the system, listed once per build and only if needed
+const std::vector<std::string>& Context::getMidiInPorts() {
+    if (!midiPortsListed) {
+        midiInPorts = MidiDevice::getInPorts();
+        midiOutPorts = MidiDevice::getOutPorts();
+        midiPortsListed = true;
+    }
+    return midiInPorts;
+}
+
+const std::vector<std::string>& Context::getMidiOutPorts() {
+    getMidiInPorts();
+    return midiOutPorts;
+}
+
+MidiDevice* Context::takeSpareInput(const std::string& _pattern) {
+    std::map<std::string, MidiDevice*>::iterator it = spareInputs.find(_pattern);
+    if (it == spareInputs.end())
+        for (it = spareInputs.begin(); it != spareInputs.end(); it++)
+            if (match(_pattern.c_str(), it->first.c_str()))
+                break;
+
+    if (it == spareInputs.end())
+        return nullptr;
+
+    MidiDevice* m = it->second;
+    spareInputs.erase(it);
+    m->clearFncs();
+    reloadStats.portsKept++;
+    return m;
+}
+
+MidiDevice* Context::takeSpareOutput(const std::string& _name) {
+    std::map<std::string, MidiDevice*>::iterator it = spareOutputs.find(_name);
+    if (it == spareOutputs.end())
+        return nullptr;
+
+    MidiDevice* m = it->second;
+    spareOutputs.erase(it);
+    reloadStats.portsKept++;
+    return m;
+}
+
+Pulse* Context::takeSparePulse(const std::string& _name) {
+    std::map<std::string, Pulse*>::iterator it = sparePulses.find(_name);
+    if (it == sparePulses.end())
+        return nullptr;
+
+    Pulse* p = it->second;
+    sparePulses.erase(it);
+    p->clearFncs();
+    reloadStats.pulsesKept++;
+    return p;
+}
+
+// Starts the pulses of the last build, once its snapshot is published
+void Context::startPulses() {
+    for (size_t i = 0; i < pulseStarts.size(); i++) {
+        PulseStart& s = pulseStarts[i];
+        s.pulse->stop();
+        if (s.clock)
+            s.pulse->sync(s.clock, s.division);
+        else if (s.period > 0.0)
+            s.pulse->start(s.period);
+    }
+    reloadStats.pulsesStarted += pulseStarts.size();
+    pulseStarts.clear();
+}
+
+// A binding of the last config with the same id and source, not taken yet
+Binding* Context::takeSpareBinding(YAML::Node _node, Device* _device, const std::string& _source) {
+    std::unordered_map<std::string, std::vector<size_t> >::iterator it = spareBindingIds.find(bindingId(_node, _device));
+    if (it == spareBindingIds.end())
+        return nullptr;
+
+    for (size_t i = 0; i < it->second.size(); i++) {
+        size_t s = it->second[i];
+        if (!spareBindingsTaken[s] && spareBindings[s].source == _source) {
+            spareBindingsTaken[s] = true;
+            return &spareBindings[s];
+        }
+    }
+    return nullptr;
+}
+
+size_t Context::takeSlot() {
+    if (freeSlots.empty())
+        return slots++;
+
+    size_t slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+}
+
+size_t Context::addBinding(YAML::Node _node, Device* _device) {
+    std::string source = YAML::Dump(_node);
+    size_t index = building->bindings.size();
+
+    // Unchanged since the last config: kept as it is, with its slot (so its
+    // values and JS function, see install)
+    Binding* spare = reuseBindings ? takeSpareBinding(_node, _device, source) : nullptr;
+    if (spare) {
+        Binding b = std::move(*spare);
+        b.index = index;
+        b.node = _node;
+        if (_node["key"].IsDefined())
+            setNodeKeys(_node, b.keys);
+
+        building->bindings.push_back(std::move(b));
+        reloadStats.bindingsKept++;
+        return index;
+    }
+
+    Binding b;
+    b.node = _node;
+    b.source = source;
+    b.device = _device;
+    b.index = index;
+    b.slot = takeSlot();
+    b.born = building->generation;
+    reloadStats.bindingsBuilt++;
+
+    if (_node["type"].IsDefined())
+        b.type = toDataType( _node["type"].as<std::string>() );
+
+    if (_node["name"].IsDefined()) {
+        b.name = _node["name"].as<std::string>();
+        b.hasName = true;
+    }
+
+    if (_node["channel"].IsDefined()) {
+        b.channel = _node["channel"].as<size_t>();
+        b.hasChannel = true;
+    }
+
+    if (_node["key"].IsDefined()) {
+        b.keys = getArrayOfKeys(_node["key"]);
+        setNodeKeys(_node, b.keys);
+    }
+
+    if (_node["status"].IsDefined())
+        b.status = MidiDevice::statusNameToByte( toUpper(_node["status"].as<std::string>()) );
+
+    // MAP
+    YAML::Node map = _node["map"];
+    if (map.IsDefined()) {
+        b.hasMap = true;
+
+        if (b.type == TYPE_BUTTON || b.type == TYPE_TOGGLE) {
+            if (map.IsMap()) {
+                b.mapOn = parseMessages(map["on"]);
+                b.mapOff = parseMessages(map["off"]);
+            }
+        }
+        else if (b.type == TYPE_STRING) {
+            if (map.IsSequence())
+                for (size_t i = 0; i < map.size(); i++)
+                    b.mapStrings.push_back( map[i].as<std::string>() );
+            else if (map.IsScalar())
+                b.mapStrings.push_back( map.as<std::string>() );
+        }
+        else if (map.IsSequence() && map.size() > 1) {
+            for (size_t i = 0; i < map.size(); i++) {
+                if (b.type == TYPE_NUMBER)
+                    b.mapNumbers.push_back( map[i].as<float>() );
+                else if (b.type == TYPE_VECTOR)
+                    b.mapVectors.push_back( map[i].as<Vector>() );
+                else if (b.type == TYPE_COLOR)
+                    b.mapColors.push_back( map[i].as<Color>() );
+            }
+        }
+    }
+
+    // OUT
+    if (_node["out"].IsDefined()) {
+        if (_node["out"].IsSequence()) 
+            for (size_t i = 0; i < _node["out"].size(); i++)
+                b.targets.push_back( parseTarget( _node["out"][i].as<std::string>() ) );
+        else if (_node["out"].IsScalar())
+            b.targets.push_back( parseTarget( _node["out"].as<std::string>() ) );
+    }
+    else
+        b.targets = targets;
+
+    for (size_t i = 0; i < b.targets.size(); i++) {
+        if ((b.targets[i].protocol == OSC_PROTOCOL || b.targets[i].protocol == UDP_PROTOCOL) && b.targets[i].sender == nullptr)
+            b.targets[i].sender = getSender(b.targets[i]);
+
+        else if (b.targets[i].protocol == CSV_PROTOCOL && b.targets[i].isFile && b.targets[i].writer == nullptr)
+            b.targets[i].writer = getWriter(b.targets[i]);
+
+        else if (b.targets[i].protocol == MIDI_PROTOCOL) {
+            std::map<std::string, Device*>::iterator it = targetsDevices.find( b.targets[i].address );
+            if (it != targetsDevices.end())
+                b.midiTargets.push_back( (MidiDevice*)it->second );
+        }
+    }
+
+    // SHAPE: a JS function, a native step or a list of native steps (ending, optionally, on a JS function)
+    std::string function;
+    if (_node["shape"].IsScalar())
+        function = _node["shape"].as<std::string>();
+    else if (_node["shape"].IsMap()) {
+        Shaper shaper;
+        if (parseShaper(_node["shape"], shaper))
+            b.shapers.push_back(shaper);
+    }
+    else if (_node["shape"].IsSequence()) {
+        for (size_t i = 0; i < _node["shape"].size(); i++) {
+            if (_node["shape"][i].IsScalar())
+                function = _node["shape"][i].as<std::string>();
+            else {
+                Shaper shaper;
+                if (parseShaper(_node["shape"][i], shaper))
+                    b.shapers.push_back(shaper);
+            }
+        }
+    }
+
+    if (_node["shape_expr"].IsScalar()) {
+        if (!b.expr.compile( _node["shape_expr"].as<std::string>() ))
+            std::cout << "shape_expr: " << b.expr.error << std::endl;
+    }
+
+    // compiled by the dispatch thread, with the node as its 'data' object
+    if (!function.empty()) {
+        b.shape = int32_t(b.slot);
+        b.function = function;
+        b.data = YAML::Clone(_node);
+    }
+
+    buildLUT(b);
+    buildOscTemplates(b);
+    parseValue(_node, b, b.initial);
+
+    building->bindings.push_back(b);
+    return b.index;
+}
+
+Sender* Context::getSender(const Target& _target) {
+    std::string key = senderKey(_target);
+
+    std::map<std::string, Sender*>::iterator it = senders.find(key);
+    if (it != senders.end())
+        return it->second;
+
+    Sender* sender = new Sender(_target.address, _target.port);
+    sender->bundling = _target.protocol == OSC_PROTOCOL && oscBundle;
+    sender->mtu = oscMtu;
+
+    if (outputAsync) {
+        SendPolicy policy = outputPolicy;
+        std::map<std::string, SendPolicy>::iterator p = outputPolicies.find(key);
+        if (p != outputPolicies.end())
+            policy = p->second;
+        sender->start(outputSize, policy);
+    }
+
+    senders[key] = sender;
+    return sender;
+}
+
+FileWriter* Context::getWriter(const Target& _target) {
+    std::map<std::string, FileWriter*>::iterator it = writers.find(_target.address);
+    if (it != writers.end())
+        return it->second;
+
+    FileWriter* writer = new FileWriter(_target.address, csvBufferSize, csvInterval, csvTimestamps);
+    writers[_target.address] = writer;
+    return writer;
+}
+
 bool Context::save(const std::string& _filename) {
-    YAML::Emitter out;
-    out.SetIndent(4);
-    out.SetSeqFormat(YAML::Flow);
-    out << config;
+    std::lock_guard<std::recursive_mutex> lock(buildMutex);
+
+    // the values belong to the dispatch thread, it writes them on the config
+    std::string yaml;
+    runTask([&]() {
+        if (active == nullptr)
+            return;
+
+        for (size_t i = 0; i < active->bindings.size(); i++)
+            storeValue(active->bindings[i], states[active->bindings[i].slot]);
+
+        YAML::Emitter out;
+        out.SetIndent(4);
+        out.SetSeqFormat(YAML::Flow);
+        out << active->config;
+        yaml = out.c_str();
+    });
+
+    if (yaml.empty())
+        return false;
 
     std::ofstream fout(_filename);
-    fout << out.c_str();
+    fout << yaml;
 
     return true;
 }
 
 bool Context::close() {
+    std::lock_guard<std::recursive_mutex> lock(buildMutex);
     safe = false;
 
+    // Stop consuming events before the devices go away
+    stopDispatch();
+
+    {
+        std::lock_guard<std::mutex> clockLock(clockMutex);
+        delete clockMaster;
+        clockMaster = nullptr;
+    }
+
+    // Pulses first, they can be following the clock of a MIDI device
+    std::vector<MidiDevice*> inputs;
     for (std::map<std::string, Device*>::iterator it = listenDevices.begin(); it != listenDevices.end(); it++) {
-        if (it->second->type == DEVICE_MIDI) {
-            delete ((MidiDevice*)it->second);
-        }
-        else if (it->second->type == DEVICE_PULSE) {
+        if (it->second->type == DEVICE_PULSE) {
             ((Pulse*)it->second)->stop();
-            delete ((Pulse*)it->second);
+            Epoch::retire((Pulse*)it->second, [](void* _pulse) { delete (Pulse*)_pulse; });
         }
+        else
+            inputs.push_back((MidiDevice*)it->second);
     }
+
+    for (size_t i = 0; i < inputs.size(); i++)
+        Epoch::retire(inputs[i], [](void* _device) { delete (MidiDevice*)_device; });
     
     listenDevices.clear();
     listenDevicesNames.clear();
-
-    shapeFncs.clear();
+    inputDevices.clear();
+
+    // nothing goes through it anymore (printStats() can still be reading it)
+    Epoch::retire(snapshot.exchange(nullptr, std::memory_order_acq_rel), [](void* _snapshot) { delete (Snapshot*)_snapshot; });
+    active = nullptr;
+    states.clear();
+    shapeModes.clear();
+    resolvedRoutes.clear();
+    routesResolved = 0;
+    freeSlots.clear();
+    slots = 0;
 
     targets.clear();
     targetsDevices.clear();
     targetsDevicesNames.clear();
+
+    for (std::map<std::string, Sender*>::iterator it = senders.begin(); it != senders.end(); it++)
+        Epoch::retire(it->second, [](void* _sender) { delete (Sender*)_sender; });
+    senders.clear();
+
+    // flushes what's left on the buffers
+    for (std::map<std::string, FileWriter*>::iterator it = writers.begin(); it != writers.end(); it++)
+        Epoch::retire(it->second, [](void* _writer) { delete (FileWriter*)_writer; });
+    writers.clear();
+    Epoch::collect();
     
     config = YAML::Node();
 
     return true;
 }
 
-bool Context::updateDevice(const std::string& _device) {
-
-    for (size_t i = 0; i < config["in"][_device].size(); i++) {
-        unsigned char status = MidiDevice::CONTROLLER_CHANGE;
-        size_t channel = 0;
-        size_t key = i;
-
-        if (config["in"][_device][i]["channel"].IsDefined())
-            channel = config["in"][_device][i]["channel"].as<size_t>();
+// Sends the current values of the bindings of a MIDI input (ex: to light its LEDs)
+bool Context::updateDevice(const Source& _source) {
+    for (size_t i = 0; i < active->bindings.size(); i++) {
+        const Binding& b = active->bindings[i];
+        if (b.device != _source.device)
+            continue;
 
         // Key Nodes
-        if (config["in"][_device][i]["key"].IsDefined()) {
-            if (config["in"][_device][i]["key"].IsScalar()) {
-                size_t key = config["in"][_device][i]["key"].as<size_t>();
-                updateNode(config["in"][_device][i], _device, status, channel, key);
-            }
-            else if (config["in"][_device][i]["key"].IsSequence()) {
-                for (size_t j = 0; j < config["in"][_device][i]["key"].size(); j++) {
-                    size_t key = config["in"][_device][i]["key"][j].as<size_t>();
-                    updateNode(config["in"][_device][i], _device, status, channel, key);
-                }
-            }
-        }
-
-        // Status Nodes
-        else {
-        //     updateNode(config["in"][_device][i], _device, status, channel, i);
-        }
+        for (size_t j = 0; j < b.keys.size(); j++)
+            updateNode(b, _source.device, MidiDevice::CONTROLLER_CHANGE, b.channel, b.keys[j]);
     }
 
     return true;
 }
 
-bool Context::doStatusExist(const std::string& _device, unsigned char _status) {
-    if ( !config["in"][_device].IsNull() ) {
-        if (config["in"][_device].IsSequence()) {
-            std::map<std::string, Device*>::iterator it = listenDevices.find(_device);
-            if (it != listenDevices.end())
-                return it->second->isStatusFnc(_status); 
-        }
-    }
-    return false;
+const Binding* Context::getStatusBinding(const Device::Table& _table, unsigned char _status) {
+    int32_t i = _table.statuses[_status];
+    if (i >= 0)
+        return &active->bindings[i];
+    return nullptr;
 }
 
-YAML::Node Context::getStatusNode(const std::string& _device, unsigned char _status) {
-    if (config["in"][_device].IsSequence()) {
-        size_t i = listenDevices[_device]->getStatusFnc(_status);
-        return config["in"][_device][i];
-    }
+const Binding* Context::getKeyBinding(const Device::Table& _table, size_t _channel, size_t _key) {
+    if (_channel >= Device::CHANNELS || _key >= Device::KEYS)
+        return nullptr;
 
-    return YAML::Node();
+    int32_t i = _table.keys[_channel][_key];
+    if (i >= 0)
+        return &active->bindings[i];
+    return nullptr;
 }
 
-bool Context::doKeyExist(const std::string& _device, size_t _channel, size_t _key) {
-    if ( !config["in"][_device].IsNull() ) {
-        if (config["in"][_device].IsSequence()) {
-            std::map<std::string, Device*>::iterator it = listenDevices.find(_device);
-            if (it != listenDevices.end())
-                return it->second->isKeyFnc(_channel, _key); 
-        }
-    }
-    return false;
+bool Context::processEvent(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float _value) {
+    lastEvent.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    const std::map<std::string, Sender*>& activeSenders = active->senders;
+
+    // Everything this event sends to the same host:port goes on one bundle
+    beginBatch();
+    for (std::map<std::string, Sender*>::const_iterator it = activeSenders.begin(); it != activeSenders.end(); it++)
+        it->second->beginBundle();
+
+    if (shapeValue(_binding, _device, _status, _channel, _key, &_value))
+        mapValue(_binding, _device, _status, _channel, _key, _value);
+
+    for (std::map<std::string, Sender*>::const_iterator it = activeSenders.begin(); it != activeSenders.end(); it++)
+        it->second->endBundle();
+    endBatch();
+
+    return true;
 }
 
-YAML::Node  Context::getKeyNode(const std::string& _device, size_t _channel, size_t _key) {
-    if (config["in"][_device].IsSequence()) {
-        size_t i = listenDevices[_device]->getKeyFnc(_channel, _key);
-        return config["in"][_device][i];
-    }
+void Context::beginBatch() {
+    for (std::map<std::string, Sender*>::const_iterator it = active->senders.begin(); it != active->senders.end(); it++)
+        it->second->beginBatch();
+}
 
-    return YAML::Node();
+void Context::endBatch() {
+    for (std::map<std::string, Sender*>::const_iterator it = active->senders.begin(); it != active->senders.end(); it++)
+        it->second->endBatch();
 }
 
-DataType Context::getKeyDataType(YAML::Node _node) {
-    if ( _node.IsDefined() ) {
-        if ( _node["type"].IsDefined() ) {
-            return toDataType( _node["type"].as<std::string>() );
-        }
+// Current value of a binding as it's stored on the YAML file
+JSValue newValue(JSContext& _js, const Binding& _binding, const BindingState& _state) {
+    if (_binding.type == TYPE_BUTTON || _binding.type == TYPE_TOGGLE)
+        return _js.newBoolean(_state.valueBool);
+
+    else if (_binding.type == TYPE_STRING)
+        return _js.newString(_state.valueString);
+
+    else if (_binding.type == TYPE_VECTOR) {
+        JSValue array = _js.newArray();
+        array.setValueAtIndex(0, _js.newNumber(_state.valueVector.x));
+        array.setValueAtIndex(1, _js.newNumber(_state.valueVector.y));
+        array.setValueAtIndex(2, _js.newNumber(_state.valueVector.z));
+        return array;
     }
-    return TYPE_NUMBER;
-}
 
-bool Context::processEvent(YAML::Node _node, 
-                        const std::string& _device, unsigned char _status, size_t _channel, 
-                        size_t _key, float _value, bool _statusOnly) {
+    else if (_binding.type == TYPE_COLOR) {
+        JSValue array = _js.newArray();
+        array.setValueAtIndex(0, _js.newNumber(_state.valueColor.r));
+        array.setValueAtIndex(1, _js.newNumber(_state.valueColor.g));
+        array.setValueAtIndex(2, _js.newNumber(_state.valueColor.b));
+        array.setValueAtIndex(3, _js.newNumber(_state.valueColor.a));
+        return array;
+    }
 
-    if (shapeValue(_node, _device, _status, _channel, _key, &_value, _statusOnly))
-        mapValue(_node, _device, _status, _channel, _key, _value);
+    else if (_binding.type == TYPE_NUMBER)
+        return _js.newNumber(_state.valueNumber);
 
-    return true;
+    return _js.newNumber(_state.valueInt);
 }
 
-bool Context::shapeValue(YAML::Node _node, 
-                            const std::string& _device, unsigned char _status, size_t _channel,
-                            size_t _key, float* _value, bool _statusOnly) {
+bool Context::shapeValue(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float* _value) {
+    if (_binding.shapers.size() > 0 && !applyShapers(_binding.shapers, js, _value))
+        return false;
 
-    if ( _node["shape"].IsDefined() ) {
-        size_t channel = _channel;
+    if (_binding.expr.isValid() && !_binding.expr.eval(js, _value, _key, _binding.hasChannel ? _channel : 0))
+        return false;
 
-        std::string status = MidiDevice::statusByteToName(_status);
+    if (_binding.shape < 0 || shapeModes[_binding.slot] == SHAPE_NONE)
+        return true;
 
-        if ( !_node["channel"].IsDefined() )
-            channel = 0;
+    // it ran out of time too many times
+    if (js.isFunctionDisabled(_binding.shape))
+        return false;
 
-        js.setGlobalValue("device", js.newString(_device));
-        js.setGlobalValue("status", js.newString( status ));
+    JSScopeMarker marker0 = js.getScopeMarker();
+
+    size_t channel = _channel;
+    if ( !_binding.hasChannel )
+        channel = 0;
+
+    // The data object is build once, only the values change
+    const BindingState& state = states[_binding.slot];
+    JSValue keyData = js.getData(_binding.shape);
+    if (state.hasValueRaw)
+        keyData.setValueForProperty("value_raw", js.newNumber(state.valueRaw));
+    if (state.hasValue)
+        keyData.setValueForProperty("value", newValue(js, _binding, state));
+
+    JSValue result;
+    shapeStatus = _status;
+    if (shapeModes[_binding.slot] == SHAPE_ARGS) {
+        // function(value, key, channel, status, device, data)
+        if ( !js.pushFunction( _binding.shape ) ) {
+            js.resetToScopeMarker(marker0);
+            return false;
+        }
+        js.newNumber(*_value);
+        js.newNumber(_key);
+        js.newNumber(channel);
+        js.newString( MidiDevice::statusByteToName(_status) );
+        js.newString(_device->name);
+        keyData.ensureExistsOnStackTop();
+        result = js.callFunction(6);
+    }
+    else {
+        // Functions without arguments read everything from globals
+        js.setGlobalValue("device", js.newString(_device->name));
+        js.setGlobalValue("status", js.newString( MidiDevice::statusByteToName(_status) ));
         js.setGlobalValue("channel", js.newNumber(channel));
         js.setGlobalValue("key", js.newNumber(_key));
         js.setGlobalValue("value", js.newNumber(*_value));
-
-        JSValue keyData = parseNode(js, _node);
         js.setGlobalValue("data", std::move(keyData));
+        result = js.getFunctionResult( _binding.shape );
+    }
+    // it threw or ran out of time
+    bool rta = (bool)result;
 
-        std::string fnc_index = _device + "_";
-        if (_statusOnly)
-            fnc_index += status;
-        else
-            fnc_index += toString( (size_t)channel ) + "_" + toString(_key);
-        
-
-        JSValue result = js.getFunctionResult( shapeFncs[ fnc_index ] );
-    
-        if (!result.isNull()) {
-
-            // Result is a string
-            if (result.isString()) {
-                JSScopeMarker marker1 = js.getScopeMarker();
-                std::cout << "Update result on string: " << result.toString() << " but don't know what to do with it"<< std::endl;
-                js.resetToScopeMarker(marker1);
-                return false;
-            }
-
-            // Result is an object
-            else if (result.isObject()) {
-                JSScopeMarker marker1 = js.getScopeMarker();
-                
-                // Check on all target devices
-                for (size_t j = 0; j < targetsDevicesNames.size(); j++) {
-
-                    // on the same status
-                    JSValue d = result.getValueForProperty( targetsDevicesNames[j] );
-                    if (!d.isUndefined()) {
-                        JSScopeMarker marker2 = js.getScopeMarker();
-
-                        for (size_t i = 0; i < d.getLength(); i++) {
-                            JSValue el = d.getValueAtIndex(i);
-                            if (el.isArray()) {
-                                if (el.getLength() > 1) {
-                                    JSScopeMarker marker3 = js.getScopeMarker();
-
-                                    MidiDevice* t = (MidiDevice*)targetsDevices[ targetsDevicesNames[j] ];
-                                    size_t k = el.getValueAtIndex(0).toInt();
-                                    size_t v = el.getValueAtIndex(1).toInt();
-                                    t->trigger(t->defaultOutStatus, 0, k, v );
-
-                                    js.resetToScopeMarker(marker3);
-                                }
-                            }
-                        }
-
-                        js.resetToScopeMarker(marker2);
-                    }
+    if (result && !result.isNull()) {
 
-                    for (size_t s = 0; s < 3; s++) {
-                        char unsigned sByte = MidiDevice::getStatusByte(s);
-                        std::string sName = MidiDevice::getStatusName(s);
-
-                        // on the same status
-                        JSValue d2 = result.getValueForProperty( targetsDevicesNames[j] + "/" + sName);
-                        if (!d2.isUndefined()) {
-                            JSScopeMarker marker2 = js.getScopeMarker();
-
-                            for (size_t i = 0; i < d2.getLength(); i++) {
-                                JSValue el = d2.getValueAtIndex(i);
-                                if (el.isArray()) {
-                                    if (el.getLength() > 1) {
-                                        JSScopeMarker marker3 = js.getScopeMarker();
-
-                                        MidiDevice* t = (MidiDevice*)targetsDevices[ targetsDevicesNames[j] ];
-                                        size_t k = el.getValueAtIndex(0).toInt();
-                                        size_t v = el.getValueAtIndex(1).toInt();
-                                        t->trigger(sByte, 0, k, v );
-
-                                        js.resetToScopeMarker(marker3);
-                                    }
-                                }
-                            }
-
-                            js.resetToScopeMarker(marker2);
-                        }
-                    }
+        // Result is a string
+        if (result.isString()) {
+            std::cout << "Update result on string: " << result.toString() << " but don't know what to do with it"<< std::endl;
+            rta = false;
+        }
 
-                }
-                
-                for (size_t j = 0; j < listenDevicesNames.size(); j++) {
-
-                    // RETURN the same status as recieved
-                    JSValue d = result.getValueForProperty(listenDevicesNames[j]);
-                    if (!d.isUndefined()) {
-                        JSScopeMarker marker2 = js.getScopeMarker();
-
-                        for (size_t i = 0; i < d.getLength(); i++) {
-                            JSValue el = d.getValueAtIndex(i);
-                            if (el.isArray()) {
-                                if (el.getLength() == 2) {
-                                    JSScopeMarker marker3 = js.getScopeMarker();
-
-                                    size_t k = el.getValueAtIndex(0).toInt();
-                                    size_t v = el.getValueAtIndex(1).toInt();
-                                    YAML::Node n = getKeyNode(listenDevicesNames[j], 0, k);
-                                    mapValue(n, listenDevicesNames[j], _status, 0, k, v);
-
-                                    js.resetToScopeMarker(marker3);
-                                }
-                                else if (el.getLength() == 3) {
-                                    JSScopeMarker marker3 = js.getScopeMarker();
-
-                                    size_t c = el.getValueAtIndex(0).toInt();
-                                    size_t k = el.getValueAtIndex(1).toInt();
-                                    float v = el.getValueAtIndex(2).toFloat();
-
-                                    YAML::Node n = getKeyNode(listenDevicesNames[j], c, k);
-                                    mapValue(n, listenDevicesNames[j], _status, c, k, v);
-
-                                    js.resetToScopeMarker(marker3);
-                                }
-                            }
-                        }
-
-                        js.resetToScopeMarker(marker2);
+        // Result is an array
+        else if (result.isArray()) {
+            JSScopeMarker marker1 = js.getScopeMarker();
+
+            for (size_t i = 0; i < result.getLength(); i++) {
+                JSValue el = result.getValueAtIndex(i);
+                if (el.isArray()) {
+                    if (el.getLength() == 2) {
+                        size_t k = el.getValueAtIndex(0).toInt();
+                        float v = el.getValueAtIndex(1).toFloat();
+                        mapValue(_binding, _device, _status, 0, k, v);
                     }
-
-                    JSValue d_leds = result.getValueForProperty(listenDevicesNames[j] + "/CONTROLLER_CHANGE");
-                    if (!d_leds.isUndefined()) {
-                        JSScopeMarker marker2 = js.getScopeMarker();
-
-                        for (size_t i = 0; i < d_leds.getLength(); i++) {
-                            JSValue el = d_leds.getValueAtIndex(i);
-
-                            if (el.isArray()) {
-                                if (el.getLength() == 2) {
-                                    JSScopeMarker marker3 = js.getScopeMarker();
-
-                                    size_t k = el.getValueAtIndex(0).toInt();
-                                    YAML::Node n = getKeyNode(listenDevicesNames[j], 0, k);
-                                    DataType n_type = getKeyDataType(n);
-                                    size_t v = el.getValueAtIndex(1).toInt();
-                                    feedback(listenDevicesNames[j], MidiDevice::CONTROLLER_CHANGE, 0, k, v);
-
-                                    js.resetToScopeMarker(marker3);
-                                }
-                                else if (el.getLength() == 3) {
-                                    JSScopeMarker marker3 = js.getScopeMarker();
-
-                                    size_t c = el.getValueAtIndex(0).toInt();
-                                    size_t k = el.getValueAtIndex(1).toInt();
-                                    YAML::Node n = getKeyNode(listenDevicesNames[j], c, k);
-                                    DataType n_type = getKeyDataType(n);
-                                    float v = el.getValueAtIndex(2).toFloat();
-                                    feedback(listenDevicesNames[j], MidiDevice::CONTROLLER_CHANGE, c, k, v);
-
-                                    js.resetToScopeMarker(marker3);
-                                }
-                            }
-                        }
-
-                        js.resetToScopeMarker(marker2);
+                    else if (el.getLength() == 3) {
+                        size_t c = el.getValueAtIndex(0).toInt();
+                        size_t k = el.getValueAtIndex(1).toInt();
+                        float v = el.getValueAtIndex(2).toFloat();
+                        mapValue(_binding, _device, _status, c, k, v);
                     }
+                    
                 }
-
                 js.resetToScopeMarker(marker1);
-                return false;
             }
 
-            // Result is an array
-            else if (result.isArray()) {
-                JSScopeMarker marker1 = js.getScopeMarker();
-
-                for (size_t i = 0; i < result.getLength(); i++) {
-                    JSValue el = result.getValueAtIndex(i);
-                    if (el.isArray()) {
-                        if (el.getLength() == 2) {
-                            size_t k = el.getValueAtIndex(0).toInt();
-                            float v = el.getValueAtIndex(1).toFloat();
-                            mapValue(_node, _device, _status, 0, k, v);
-                        }
-                        else if (el.getLength() == 3) {
-                            size_t c = el.getValueAtIndex(0).toInt();
-                            size_t k = el.getValueAtIndex(1).toInt();
-                            float v = el.getValueAtIndex(2).toFloat();
-                            mapValue(_node, _device, _status, c, k, v);
-                        }
-                        
-                    }
-                }
+            rta = false;
+        }
 
+        // Result is an object, each key is routed through the table built on load
+        else if (result.isObject()) {
+            JSValue keys = result.getEnumerator();
+            JSScopeMarker marker1 = js.getScopeMarker();
+
+            JSValue list;
+            Routes scratch;
+            while ((list = keys.getNextProperty(routeKey))) {
+                const Routes* r = getRoutes(routeKey, scratch);
+                if (r)
+                    for (size_t i = 0; i < r->size(); i++)
+                        route((*r)[i], list, _status);
                 js.resetToScopeMarker(marker1);
-                return false;
             }
-            
-            // Result is a number
-            else if (result.isNumber())
-                *_value = result.toFloat();
 
-            // Result is a boolean
-            else if (result.isBoolean())
-                return result.toBool();
+            rta = false;
         }
+        
+        // Result is a number
+        else if (result.isNumber())
+            *_value = result.toFloat();
+
+        // Result is a boolean
+        else if (result.isBoolean())
+            rta = result.toBool();
     }
 
-    return true;
+    js.resetToScopeMarker(marker0);
+    return rta;
 }
 
-bool Context::mapValue(  YAML::Node _node, 
-                            const std::string& _device, unsigned char _status, size_t _channel, 
-                            size_t _key, float _value) {
+// Keys a shape function can return on an object: target devices (on their
+// default status or on "name/STATUS"), listen devices and "name/CONTROLLER_CHANGE"
+// for their LEDs. Wildcards on either side are resolved on the first use.
+void Context::buildRoutes() {
+    for (size_t i = 0; i < building->bindings.size(); i++)
+        if (!building->bindings[i].name.empty())
+            building->bindingNames[building->bindings[i].name].push_back(i);
 
-    DataType type = getKeyDataType(_node);
-    _node["value_raw"] = _value;
+    for (size_t j = 0; j < targetsDevicesNames.size(); j++) {
+        const std::string& name = targetsDevicesNames[j];
+        Device* t = targetsDevices[name];
 
-    // BUTTON
-    if (type == TYPE_BUTTON) {
-        bool value = _value > 0;
-        _node["value"] = value;
-        return updateNode(_node, _device, _status, _channel, _key);
-    }
-    
-    // TOGGLE
-    else if ( type == TYPE_TOGGLE ) {
-        if (_value > 0) {
-            bool value = false;
-                
-            if (_node["value"])
-                value = _node["value"].as<bool>();
+        Route r = { ROUTE_TARGET, t, ((MidiDevice*)t)->defaultOutStatus, 0 };
+        addRoute(name, "", r);
 
-            _node["value"] = !value;
-            return updateNode(_node, _device, _status, _channel, _key);
+        for (size_t s = 0; s < 3; s++) {
+            r.status = MidiDevice::getStatusByte(s);
+            addRoute(name, "/" + MidiDevice::getStatusName(s), r);
         }
     }
 
-    // STATE
-    else if ( type == TYPE_STRING ) {
-        int value = (int)_value;
-        std::string value_str = toString(value);
+    for (size_t j = 0; j < listenDevicesNames.size(); j++) {
+        const std::string& name = listenDevicesNames[j];
+        Device* listen = listenDevices[name];
 
-        if ( _node["map"] ) {
-            if ( _node["map"].IsSequence() ) {
-                float total = _node["map"].size();
+        // the bindings of the device on this snapshot (a clock only
+        // input, without any, is left past the end)
+        size_t source = 0;
+        while (source < building->sources.size() && building->sources[source].device != listen)
+            source++;
 
-                if (total == 1) {
-                    value_str = _node["map"][0].as<std::string>();
-                }
-                else if (value == 127.0f) {
-                    value_str = _node["map"][total-1].as<std::string>();
-                } 
-                else {
-                    size_t index = (value / 127.0f) * _node["map"].size();
-                    value_str = _node["map"][index].as<std::string>();
-                } 
-            }
-            else if ( _node["map"].IsScalar() ) {
-                value_str = _node["map"].as<std::string>();
-            }
+        Route r = { ROUTE_LISTEN, listen, 0, source };
+        addRoute(name, "", r);
+
+        r.type = ROUTE_FEEDBACK;
+        r.status = MidiDevice::CONTROLLER_CHANGE;
+        addRoute(name, "/CONTROLLER_CHANGE", r);
+    }
+}
+
+void Context::addRoute(const std::string& _name, const std::string& _suffix, const Route& _route) {
+    std::vector<RouteName>& routeNames = building->routeNames;
+    building->routes[_name + _suffix].push_back(_route);
+
+    for (size_t i = 0; i < routeNames.size(); i++) {
+        if (routeNames[i].name == _name && routeNames[i].suffix == _suffix) {
+            routeNames[i].routes.push_back(_route);
+            return;
         }
-            
-        _node["value"] = value_str;
-        return updateNode(_node, _device, _status, _channel, _key);
     }
-    
-    // SCALAR
-    else if ( type == TYPE_NUMBER ) {
-        float value = _value;
-
-        if ( _node["map"] ) {
-            value /= 127.0f;
-            if ( _node["map"].IsSequence() ) {
-                if ( _node["map"].size() > 1 ) {
-                    float total = _node["map"].size() - 1;
-
-                    size_t i_low = value * total;
-                    size_t i_high = M_MIN(i_low + 1, size_t(total));
-                    float pct = (value * total) - (float)i_low;
-                    value = lerp(   _node["map"][i_low].as<float>(),
-                                    _node["map"][i_high].as<float>(),
-                                    pct );
-                }
+
+    RouteName n;
+    n.name = _name;
+    n.suffix = _suffix;
+    n.routes.push_back(_route);
+    routeNames.push_back(n);
+}
+
+// Keys that need the wildcards are remembered, found or not, up to ROUTE_CACHE
+// of them; past that they are resolved each time into _scratch.
+const Routes* Context::getRoutes(const std::string& _key, Routes& _scratch) {
+    std::unordered_map<std::string, Routes>::const_iterator it = active->routes.find(_key);
+    if (it != active->routes.end())
+        return it->second.empty() ? nullptr : &it->second;
+
+    // the ones already resolved on this snapshot
+    it = resolvedRoutes.find(_key);
+    if (it != resolvedRoutes.end())
+        return it->second.empty() ? nullptr : &it->second;
+
+    const std::vector<RouteName>& routeNames = active->routeNames;
+
+    // "Client-3/NOTE_ON" is matched as "Client-3" + "/NOTE_ON"
+    std::string name = _key;
+    std::string suffix;
+    size_t slash = _key.rfind('/');
+    if (slash != std::string::npos) {
+        for (size_t i = 0; i < routeNames.size(); i++) {
+            if (!routeNames[i].suffix.empty() && _key.compare(slash, std::string::npos, routeNames[i].suffix) == 0) {
+                name = _key.substr(0, slash);
+                suffix = routeNames[i].suffix;
+                break;
             }
         }
-            
-        _node["value"] = value;
-        return updateNode(_node, _device, _status, _channel, _key);
     }
-    
-    // VECTOR
-    else if ( type == TYPE_VECTOR ) {
-        float pct = _value / 127.0f;
-        Vector value = Vector(0.0, 0.0, 0.0);
 
-        if ( _node["map"] ) {
-            if ( _node["map"].IsSequence() ) {
-                if ( _node["map"].size() > 1 ) {
-                    float total = _node["map"].size() - 1;
+    // Wildcards on the config name (a key with the real device name) 
+    // or on the key (all the devices it matches)
+    Routes found;
+    for (size_t i = 0; i < routeNames.size(); i++) {
+        const RouteName& n = routeNames[i];
+        if (n.suffix == suffix && (match(n.name.c_str(), name.c_str()) || match(name.c_str(), n.name.c_str())))
+            found.insert(found.end(), n.routes.begin(), n.routes.end());
+    }
+
+    // Remember it, next time is a direct hit. The map is never cleared
+    // here, as shape functions called while routing can come back
+    if (routesResolved < ROUTE_CACHE) {
+        routesResolved++;
+        Routes& r = resolvedRoutes[_key];
+        r.swap(found);
+        return r.empty() ? nullptr : &r;
+    }
 
-                    size_t i_low = pct * total;
-                    size_t i_high = M_MIN(i_low + 1, size_t(total));
+    if (found.empty())
+        return nullptr;
 
-                    value = lerp(   _node["map"][i_low].as<Vector>(),
-                                    _node["map"][i_high].as<Vector>(),
-                                    (pct * total) - (float)i_low );
-                }
+    _scratch.swap(found);
+    return &_scratch;
+}
+
+// The values of a routed key are [key, value] or [channel, key, value] arrays
+void Context::route(const Route& _route, JSValue& _list, unsigned char _status) {
+    JSScopeMarker marker = js.getScopeMarker();
+
+    for (size_t i = 0; i < _list.getLength(); i++) {
+        JSValue el = _list.getValueAtIndex(i);
+        if (el.isArray()) {
+            size_t length = el.getLength();
+
+            // MIDI out devices always take the first two
+            if (length == 2 || (length > 1 && _route.type == ROUTE_TARGET)) {
+                size_t k = el.getValueAtIndex(0).toInt();
+                size_t v = el.getValueAtIndex(1).toInt();
+                routeValue(_route, 0, k, v, _status);
+            }
+            else if (length == 3) {
+                size_t c = el.getValueAtIndex(0).toInt();
+                size_t k = el.getValueAtIndex(1).toInt();
+                float v = el.getValueAtIndex(2).toFloat();
+                routeValue(_route, c, k, v, _status);
             }
         }
-            
-        _node["value"] = value;
-        return updateNode(_node, _device, _status, _channel, _key);
+        js.resetToScopeMarker(marker);
     }
+}
 
-    // COLOR
-    else if ( type == TYPE_COLOR ) {
-        float pct = _value / 127.0f;
-        Color value = Color(0.0, 0.0, 0.0);
+bool Context::routeValue(const Route& _route, size_t _channel, size_t _key, float _value, unsigned char _status) {
+    if (_route.type == ROUTE_TARGET) {
+        ((MidiDevice*)_route.device)->trigger(_route.status, _channel, _key, _value);
+        return true;
+    }
+    else if (_route.type == ROUTE_FEEDBACK)
+        return feedback(_route.device, _route.status, _channel, _key, _value);
 
-        if ( _node["map"] ) {
-            if ( _node["map"].IsSequence() ) {
-                if ( _node["map"].size() > 1 ) {
-                    float total = _node["map"].size() - 1;
+    if (_route.source >= active->sources.size())
+        return false;
 
-                    size_t i_low = pct * total;
-                    size_t i_high = M_MIN(i_low + 1, size_t(total));
+    const Binding* n = getKeyBinding(active->sources[_route.source].table, _channel, _key);
+    if (n)
+        return mapValue(*n, _route.device, _status, _channel, _key, _value);
+    return false;
+}
 
-                    value = lerp(   _node["map"][i_low].as<Color>(),
-                                    _node["map"][i_high].as<Color>(),
-                                    (pct * total) - (float)i_low );
-                }
+// Native functions for the shape functions, so they can send values without
+// building arrays and objects for them. They return true if it went somewhere.
+
+// emit(target, key, value) or emit(target, channel, key, value)
+// 'target' is any key a shape function can return on an object
+duk_ret_t Context::jsEmit(duk_context* _ctx) {
+    Context* context = (Context*)JSContext::getUserData(_ctx);
+    duk_idx_t nargs = duk_get_top(_ctx);
+    if (context == nullptr || nargs < 3)
+        return DUK_RET_TYPE_ERROR;
+
+    duk_idx_t first = nargs > 3 ? 1 : 0;
+    size_t channel = nargs > 3 ? duk_to_int(_ctx, 1) : 0;
+    size_t key = duk_to_int(_ctx, first + 1);
+    float value = duk_to_number(_ctx, first + 2);
+
+    duk_size_t length = 0;
+    const char* target = duk_to_lstring(_ctx, 0, &length);
+    context->routeKey.assign(target, length);
+
+    bool rta = false;
+    Routes scratch;
+    const Routes* r = context->getRoutes(context->routeKey, scratch);
+    if (r)
+        for (size_t i = 0; i < r->size(); i++)
+            rta |= context->routeValue((*r)[i], channel, key, value, context->shapeStatus);
+
+    duk_push_boolean(_ctx, rta);
+    return 1;
+}
+
+// feedback(device, channel, key, value), ex: to light the LEDs of a controller
+duk_ret_t Context::jsFeedback(duk_context* _ctx) {
+    Context* context = (Context*)JSContext::getUserData(_ctx);
+    if (context == nullptr)
+        return DUK_RET_TYPE_ERROR;
+
+    size_t channel = duk_to_int(_ctx, 1);
+    size_t key = duk_to_int(_ctx, 2);
+    float value = duk_to_number(_ctx, 3);
+
+    context->routeKey = duk_to_string(_ctx, 0);
+    context->routeKey += "/CONTROLLER_CHANGE";
+
+    bool rta = false;
+    Routes scratch;
+    const Routes* r = context->getRoutes(context->routeKey, scratch);
+    if (r)
+        for (size_t i = 0; i < r->size(); i++)
+            rta |= context->routeValue((*r)[i], channel, key, value, context->shapeStatus);
+
+    duk_push_boolean(_ctx, rta);
+    return 1;
+}
+
+// A MIDI message of a replay file: "<seconds> <device> <hex bytes>"
+struct ReplayEvent {
+    std::chrono::steady_clock::time_point   time;
+    MidiDevice*                             device;
+    std::vector<unsigned char>              message;
+};
+
+// Runs the pulses and the replayed messages on the virtual clock for _seconds
+bool Context::simulate(double _seconds, const std::string& _replay) {
+    if (!VirtualClock::isEnabled())
+        return false;
+
+    std::vector<ReplayEvent> events;
+    if (!_replay.empty()) {
+        std::ifstream file(_replay.c_str());
+        if (!file.is_open()) {
+            std::cout << "Can't open replay file " << _replay << std::endl;
+            return false;
+        }
+
+        std::string line;
+        size_t lineNumber = 0;
+        while (std::getline(file, line)) {
+            lineNumber++;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream in(line);
+            ReplayEvent event;
+            std::string device, byte;
+            double seconds;
+            if (!(in >> seconds >> device))
+                continue;
+            event.time = VirtualClock::start() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+            event.device = nullptr;
+            for (size_t d = 0; d < inputDevices.size() && event.device == nullptr; d++)
+                if (inputDevices[d]->name == device || match(device.c_str(), inputDevices[d]->name.c_str()))
+                    event.device = inputDevices[d];
+
+            while (in >> byte)
+                event.message.push_back( (unsigned char)strtol(byte.c_str(), NULL, 16) );
+
+            if (event.device == nullptr || event.message.empty()) {
+                std::cout << "Skipping line " << lineNumber << " of " << _replay << ": no MIDI input " << device << " or message" << std::endl;
+                continue;
             }
+            events.push_back(event);
         }
-        
-        _node["value"] = value;
-        return updateNode(_node, _device, _status, _channel, _key);
+
+        std::stable_sort(events.begin(), events.end(), [](const ReplayEvent& _a, const ReplayEvent& _b) { 
+            return _a.time < _b.time; 
+        });
     }
 
-    else if (   type == TYPE_MIDI_NOTE || 
-                type == TYPE_MIDI_CONTROLLER_CHANGE ||
-                type == TYPE_MIDI_TIMING_TICK ) {
+    const std::chrono::steady_clock::time_point end = VirtualClock::start() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(_seconds));
+    size_t e = 0;
+
+    // this thread stands for the dispatch one, the loaded snapshot goes first
+    drain();
+
+    // jump to whatever comes first, a pulse or a replayed message
+    while (true) {
+        std::chrono::steady_clock::time_point next = end;
+        std::chrono::steady_clock::time_point deadline;
+        if (scheduler.getNextDeadline(deadline))
+            next = std::min(next, deadline);
+        if (e < events.size())
+            next = std::min(next, events[e].time);
+        if (next >= end)
+            break;
+
+        VirtualClock::advance(next);
+
+        for (; e < events.size() && events[e].time <= next; e++) {
+            MidiDevice* device = events[e].device;
 
-        _node["value"] = int(_value);
-        return updateNode(_node, _device, _status, _channel, _key);
+            MidiEvent event;
+            MidiDevice::decode(events[e].message, event);
+            event.timestamp = VirtualClock::micros();
+            event.device = device->id.load(std::memory_order_relaxed);
+
+            if (event.status >= MidiDevice::TIMING_TICK || event.status == MidiDevice::SONG_POSITION)
+                device->clock.process(event.status, event.key, event.value, event.timestamp);
+
+            device->queue.push(event);
+            drain();
+        }
+
+        // the ticks are queued like on the scheduler thread
+        scheduler.tickDue();
+        drain();
     }
 
-    return false;
+    VirtualClock::advance(end);
+    return true;
 }
 
-std::vector<Target> Context::getTargetsForNode(YAML::Node _node) {
-    if (_node["out"].IsDefined() ) {
-        std::vector<Target> keyTargets;
-        if (_node["out"].IsSequence()) 
-            for (size_t i = 0; i < _node["out"].size(); i++) {
-                keyTargets.push_back( parseTarget( _node["out"][i].as<std::string>() ) );
-            }
-        else if (_node["out"].IsScalar()) {
-            Target target = parseTarget( _node["out"].as<std::string>() );
-            keyTargets.push_back( target );
+// Controls the clock master: start, stop, continue, bpm <value> or position <sixteenths>
+bool Context::transport(const std::string& _command, double _value) {
+    std::lock_guard<std::mutex> lock(clockMutex);
+    if (clockMaster == nullptr)
+        return false;
+
+    if (_command == "start")
+        clockMaster->sendStart();
+    else if (_command == "stop")
+        clockMaster->sendStop();
+    else if (_command == "continue")
+        clockMaster->sendContinue();
+    else if (_command == "bpm")
+        clockMaster->setBpm(_value);
+    else if (_command == "position")
+        clockMaster->sendSongPosition(size_t(_value));
+    else
+        return false;
+
+    return true;
+}
+
+// transport(command[, value]), see Context::transport()
+duk_ret_t Context::jsTransport(duk_context* _ctx) {
+    Context* context = (Context*)JSContext::getUserData(_ctx);
+    if (context == nullptr)
+        return DUK_RET_TYPE_ERROR;
+
+    std::string command = duk_to_string(_ctx, 0);
+    double value = duk_is_undefined(_ctx, 1) ? 0.0 : duk_to_number(_ctx, 1);
+    duk_push_boolean(_ctx, context->transport(command, value));
+    return 1;
+}
+
+// clock(device) returns { bpm, beat, bar, phase, running } of its MIDI clock,
+// 'beat' and 'bar' count from 0 since START and 'phase' goes from 0 to 1 on each beat
+duk_ret_t Context::jsClock(duk_context* _ctx) {
+    Context* context = (Context*)JSContext::getUserData(_ctx);
+    if (context == nullptr)
+        return DUK_RET_TYPE_ERROR;
+
+    context->routeKey = duk_to_string(_ctx, 0);
+    Routes scratch;
+    const Routes* r = context->getRoutes(context->routeKey, scratch);
+    if (r) {
+        for (size_t i = 0; i < r->size(); i++) {
+            const Route& route = (*r)[i];
+            if (route.type != ROUTE_LISTEN || route.device->type != DEVICE_MIDI)
+                continue;
+
+            const ClockFollower& c = ((MidiDevice*)route.device)->clock;
+            uint64_t now = VirtualClock::micros();
+            double beat = c.getPosition(now) / CLOCK_PPQN;
+
+            duk_idx_t obj = duk_push_object(_ctx);
+            duk_push_number(_ctx, c.getBpm());
+            duk_put_prop_string(_ctx, obj, "bpm");
+            duk_push_number(_ctx, std::floor(beat));
+            duk_put_prop_string(_ctx, obj, "beat");
+            duk_push_number(_ctx, std::floor(beat / c.beatsPerBar));
+            duk_put_prop_string(_ctx, obj, "bar");
+            duk_push_number(_ctx, beat - std::floor(beat));
+            duk_put_prop_string(_ctx, obj, "phase");
+            duk_push_boolean(_ctx, c.isRunning(now));
+            duk_put_prop_string(_ctx, obj, "running");
+            return 1;
         }
-        return keyTargets;
     }
-    else
-        return targets;
+
+    duk_push_null(_ctx);
+    return 1;
 }
 
+// send(name, value) maps the value on the bindings with that name and sends it to their outputs
+duk_ret_t Context::jsSend(duk_context* _ctx) {
+    Context* context = (Context*)JSContext::getUserData(_ctx);
+    if (context == nullptr)
+        return DUK_RET_TYPE_ERROR;
+
+    float value = duk_to_number(_ctx, 1);
+    context->routeKey = duk_to_string(_ctx, 0);
+
+    bool rta = false;
+    const Snapshot* s = context->active;
+    std::unordered_map<std::string, std::vector<size_t> >::const_iterator it = s->bindingNames.find(context->routeKey);
+    if (it != s->bindingNames.end()) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            const Binding& b = s->bindings[it->second[i]];
+            rta |= context->mapValue(b, b.device, context->shapeStatus, b.channel, b.keys.empty() ? 0 : b.keys[0], value);
+        }
+    }
 
-bool Context::updateNode(YAML::Node _node, 
-                        const std::string& _device, unsigned char _status, size_t _channel, 
-                        size_t _key) {
+    duk_push_boolean(_ctx, rta);
+    return 1;
+}
 
-    if ( !_node["value"].IsDefined() )
-        return false;
+bool Context::mapValue(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float _value) {
+    BindingState& state = states[_binding.slot];
 
-    // Define out targets
-    std::vector<Target> keyTargets = getTargetsForNode(_node);
-        
-    // KEY
-    std::string name = "unknown";
-    if ( _node.IsDefined() ) {
-        if ( _node["name"].IsDefined() ) {
-            name = _node["name"].as<std::string>();
+    state.valueRaw = _value;
+    state.hasValueRaw = true;
+
+    // BUTTON
+    if (_binding.type == TYPE_BUTTON) {
+        state.valueBool = _value > 0;
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
+    }
+    
+    // TOGGLE
+    else if ( _binding.type == TYPE_TOGGLE ) {
+        if (_value > 0) {
+            state.valueBool = !state.valueBool;
+            state.hasValue = true;
+            return updateNode(_binding, _device, _status, _channel, _key);
         }
-        else {
-            name = ""; 
-            if ( _node["channel"].IsDefined() )
-                name += toString(_channel) + ",";
+    }
+
+    // STATE
+    else if ( _binding.type == TYPE_STRING ) {
+        if (_binding.mapStrings.size() == 0)
+            state.valueString = toString( (int)_value );
+        else if (_binding.lutStrings.size() > 0 && isLutIndex(_value))
+            state.valueString = _binding.mapStrings[ _binding.lutStrings[(size_t)_value] ];
+        else
+            state.valueString = _binding.mapStrings[ mapString(_binding, _value) ];
 
-            if (_key != 0)
-                name += toString(_key);
-        } 
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
     }
+    
+    // SCALAR
+    else if ( _binding.type == TYPE_NUMBER ) {
+        if (_binding.lutNumbers.size() > 0 && isLutIndex(_value))
+            state.valueNumber = _binding.lutNumbers[(size_t)_value];
+        else
+            state.valueNumber = mapNumber(_binding, _value);
 
-    DataType type = getKeyDataType(_node);
-    YAML::Node value = _node["value"];
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
+    }
+    
+    // VECTOR
+    else if ( _binding.type == TYPE_VECTOR ) {
+        if (_binding.lutVectors.size() > 0 && isLutIndex(_value))
+            state.valueVector = _binding.lutVectors[(size_t)_value];
+        else
+            state.valueVector = mapVector(_binding, _value);
 
-    // BUTTON and TOGGLE
-    if ( type == TYPE_TOGGLE || type == TYPE_BUTTON ) {
-        std::string value_str = (value.as<bool>()) ? "on" : "off";
-        
-        if (_node["map"]) {
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
+    }
 
-            if (_node["map"][value_str]) {
+    // COLOR
+    else if ( _binding.type == TYPE_COLOR ) {
+        if (_binding.lutColors.size() > 0 && isLutIndex(_value))
+            state.valueColor = _binding.lutColors[(size_t)_value];
+        else
+            state.valueColor = mapColor(_binding, _value);
 
-                // If the end mapped string is a sequence
-                if (_node["map"][value_str].IsSequence()) {
-                    for (size_t i = 0; i < _node["map"][value_str].size(); i++) {
-                        std::string prop = name;
-                        std::string msg = "";
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
+    }
 
-                        if ( parseString(_node["map"][value_str][i], prop, msg) ) {
-                            for (size_t t = 0; t < keyTargets.size(); t++)
-                                broadcast(keyTargets[t], prop, msg);
-                        }
-                    }
-                }
-                else {
-                    std::string prop = name;
-                    std::string msg = "";
+    else if (   _binding.type == TYPE_MIDI_NOTE || 
+                _binding.type == TYPE_MIDI_CONTROLLER_CHANGE ||
+                _binding.type == TYPE_MIDI_TIMING_TICK ) {
 
-                    if ( parseString(_node["map"][value_str], prop, msg) ) {
-                        for (size_t t = 0; t < keyTargets.size(); t++)
-                            broadcast(keyTargets[t], prop, msg);
-                    }
-                }
+        state.valueInt = int(_value);
+        state.hasValue = true;
+        return updateNode(_binding, _device, _status, _channel, _key);
+    }
 
-            }
+    return false;
+}
 
-        }
-        else {
-            for (size_t t = 0; t < keyTargets.size(); t++)
-                broadcast(keyTargets[t], name, value_str);
+bool Context::updateNode(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key) {
+    const BindingState& state = states[_binding.slot];
 
+    if ( !state.hasValue )
+        return false;
+
+    const std::vector<Target>& keyTargets = _binding.targets;
+        
+    // KEY
+    std::string unnamed;
+    if ( !_binding.hasName ) {
+        if ( _binding.hasChannel )
+            unnamed += toString(_channel) + ",";
+
+        if (_key != 0)
+            unnamed += toString(_key);
+    }
+    const std::string& name = _binding.hasName ? _binding.name : unnamed;
+
+    // BUTTON and TOGGLE
+    if ( _binding.type == TYPE_TOGGLE || _binding.type == TYPE_BUTTON ) {
+        
+        for (size_t t = 0; t < keyTargets.size(); t++) {
+            if (isOscTemplate(_binding, t)) {
+                const std::vector<std::string>& packets = state.valueBool ? _binding.oscTemplates[t].on : _binding.oscTemplates[t].off;
+                for (size_t i = 0; i < packets.size(); i++)
+                    broadcast_OSC(keyTargets[t], packets[i]);
+            }
+            else if (_binding.hasMap) {
+                const std::vector<BindingMessage>& messages = state.valueBool ? _binding.mapOn : _binding.mapOff;
+                for (size_t i = 0; i < messages.size(); i++)
+                    broadcast(keyTargets[t], messages[i].hasProp ? messages[i].prop : name, messages[i].msg);
+            }
+            else
+                broadcast(keyTargets[t], name, std::string(state.valueBool ? "on" : "off"));
         }
 
-        if ( listenDevices[_device]->type == DEVICE_MIDI ) 
-            feedback(_device, _status, _channel, _key, _node["value"].as<bool>() ? 127 : 0);
+        if ( _device->type == DEVICE_MIDI ) 
+            feedback(_device, _status, _channel, _key, state.valueBool ? 127 : 0);
 
         return true;
     }
 
     // STATE
-    else if ( type == TYPE_STRING ) {
+    else if ( _binding.type == TYPE_STRING ) {
         for (size_t t = 0; t < keyTargets.size(); t++)
-            broadcast(keyTargets[t], name, value.as<std::string>());
+            if (isOscTemplate(_binding, t))
+                broadcast_OSC(keyTargets[t], _binding.oscTemplates[t], state.valueString);
+            else
+                broadcast(keyTargets[t], name, state.valueString);
 
         return true;
     }
 
     // SCALAR
-    else if ( type == TYPE_NUMBER ) {
+    else if ( _binding.type == TYPE_NUMBER ) {
         for (size_t t = 0; t < keyTargets.size(); t++)
-            broadcast(keyTargets[t], name, value.as<float>());
+            if (isOscTemplate(_binding, t))
+                broadcast_OSC(keyTargets[t], _binding.oscTemplates[t], state.valueNumber);
+            else
+                broadcast(keyTargets[t], name, state.valueNumber);
 
         return true;
     }
 
     // VECTOR
-    else if ( type == TYPE_VECTOR ) {
+    else if ( _binding.type == TYPE_VECTOR ) {
         for (size_t t = 0; t < keyTargets.size(); t++)
-            broadcast(keyTargets[t], name, value.as<Vector>());
+            if (isOscTemplate(_binding, t))
+                broadcast_OSC(keyTargets[t], _binding.oscTemplates[t], state.valueVector);
+            else
+                broadcast(keyTargets[t], name, state.valueVector);
 
         return true;
     }
 
     // COLOR
-    else if ( type == TYPE_COLOR ) {
+    else if ( _binding.type == TYPE_COLOR ) {
         for (size_t t = 0; t < keyTargets.size(); t++)
-            broadcast(keyTargets[t], name, value.as<Color>());
+            if (isOscTemplate(_binding, t))
+                broadcast_OSC(keyTargets[t], _binding.oscTemplates[t], state.valueColor);
+            else
+                broadcast(keyTargets[t], name, state.valueColor);
         
         return true;
     }
 
-    else if (targetsDevices.size() > 0) {
-        size_t value = _node["value"].as<int>();
+    else {
+        size_t value = state.valueInt;
 
-        for (size_t t = 0; t < keyTargets.size(); t++) {
-            if (keyTargets[t].protocol == MIDI_PROTOCOL) {
-                std::string name = keyTargets[t].address;
-
-                if ( targetsDevices.find( name ) == targetsDevices.end() ) {
-                    MidiDevice* d = (MidiDevice*)targetsDevices[ name ];
+        for (size_t t = 0; t < _binding.midiTargets.size(); t++) {
+            MidiDevice* d = _binding.midiTargets[t];
 
-                    if ( type == TYPE_MIDI_NOTE) {
-                        if (value == 0)
-                            d->trigger( MidiDevice::NOTE_OFF, 0, _key, 0 );
-                        else 
-                            d->trigger( MidiDevice::NOTE_ON, 0, _key, value );
-                    }
-                    else if ( type == TYPE_MIDI_CONTROLLER_CHANGE )
-                        d->trigger( MidiDevice::CONTROLLER_CHANGE, 0, _key, value );
-                    
-                    else if ( type == TYPE_MIDI_TIMING_TICK )
-                        d->trigger( MidiDevice::TIMING_TICK, 0 );
-                }
+            if ( _binding.type == TYPE_MIDI_NOTE) {
+                if (value == 0)
+                    d->trigger( MidiDevice::NOTE_OFF, 0, _key, 0 );
+                else 
+                    d->trigger( MidiDevice::NOTE_ON, 0, _key, value );
             }
+            else if ( _binding.type == TYPE_MIDI_CONTROLLER_CHANGE )
+                d->trigger( MidiDevice::CONTROLLER_CHANGE, 0, _key, value );
+            
+            else if ( _binding.type == TYPE_MIDI_TIMING_TICK )
+                d->trigger( MidiDevice::TIMING_TICK, 0 );
         }
     }
 
     return false;
 }
 
-bool Context::feedback(const std::string& _device, unsigned char _status, size_t _channel, size_t _key, size_t _value) {
-    MidiDevice* midi = static_cast<MidiDevice*>(listenDevices[_device]);
+bool Context::feedback(Device* _device, unsigned char _status, size_t _channel, size_t _key, size_t _value) {
+    if (_device->type != DEVICE_MIDI)
+        return false;
+
+    MidiDevice* midi = static_cast<MidiDevice*>(_device);
     midi->trigger( _status, _channel, _key, _value);
     return true;
 }
 
+void Context::startDispatch() {
+    if (dispatching)
+        return;
+
+    dispatching = true;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        dispatchAlive = true;
+    }
+    dispatchThread = std::thread(&Context::dispatch, this);
+}
+
+void Context::stopDispatch() {
+    if (!dispatching)
+        return;
+
+    dispatching = false;
+    notifyDispatch();
+    dispatchThread.join();
+}
+
+void Context::notifyDispatch() {
+    dispatchPending.store(true, std::memory_order_release);
+    dispatchCondition.notify_one();
+}
+
+void Context::dispatch() {
+    while (dispatching) {
+        dispatchPending.store(false, std::memory_order_release);
+
+        // Nothing to do, wait for the next MIDI callback or pulse
+        if (drain() == 0) {
+            idleGc();
 
+            std::unique_lock<std::mutex> lock(dispatchMutex);
+            dispatchCondition.wait_for(lock, std::chrono::milliseconds(1), [&]() { 
+                return dispatchPending.load(std::memory_order_acquire) || !dispatching; 
+            });
+        }
+    }
+
+    // the tasks asked for meanwhile run now, the next ones on their thread
+    Epoch::Guard guard;
+    const Snapshot* s = snapshot.load(std::memory_order_acquire);
+    if (s != nullptr && s != active)
+        install(s);
+    runTasks(true);
+}
+
+// Processes the events waiting on the queues of the inputs and the pulses,
+// with the last snapshot published. Returns how many there were
+size_t Context::drain() {
+    Epoch::Guard guard;
+    const Snapshot* s = snapshot.load(std::memory_order_acquire);
+    if (s == nullptr)
+        return 0;
+
+    if (s != active)
+        install(s);
+
+    if (tasksPending.load(std::memory_order_acquire))
+        runTasks();
+
+    // Datagrams of the whole cycle go out together at the end of it
+    beginBatch();
+
+    size_t total = 0;
+    for (size_t d = 0; d < s->sources.size(); d++) {
+        const Source& source = s->sources[d];
+        auto process = [&](const MidiEvent& _event) {
+            if (source.device->type == DEVICE_MIDI)
+                ((MidiDevice*)source.device)->process(source.table, _event);
+            else
+                ((Pulse*)source.device)->process(source.table, _event);
+        };
+
+        MidiEvent event;
+        while (source.device->queue.pop(event)) {
+            process(event);
+            total++;
+        }
+
+        // Values that didn't fit on the queue go after it's been drained
+        uint64_t now = VirtualClock::micros();
+        total += source.device->queue.popCoalesced(uint32_t(d), now, process);
+    }
+
+    endBatch();
+    return total;
+}
+
+// Sets up what's new on a snapshot the first time it's used: the values
+// and the JS functions of the bindings built for it, and the 'global'
+// object if it changed. Kept bindings go on as they were
+void Context::install(const Snapshot* _snapshot) {
+    const Snapshot& s = *_snapshot;
+
+    js.setCacheFolder(s.jsCache);
+    js.setTimeBudget(s.jsTimeout, s.jsStrikes);
+    jsGcIdle = s.jsGcIdle;
+    jsGcInterval = s.jsGcInterval;
+    js.cacheHits = 0;
+    js.cacheMisses = 0;
+    js.compileTime = 0.0;
+
+    // JS Globals
+    if (s.globalBorn > activeGeneration) {
+        JSValue global = parseNode(js, s.global);
+        js.setGlobalValue("global", std::move(global));
+    }
+
+    if (states.size() < s.slots) {
+        states.resize(s.slots);
+        shapeModes.resize(s.slots, SHAPE_NONE);
+    }
+
+    for (size_t i = 0; i < s.bindings.size(); i++) {
+        const Binding& b = s.bindings[i];
+
+        // a reload gives disabled functions another chance, like a fresh compile
+        if (b.born <= activeGeneration) {
+            if (b.shape >= 0)
+                js.resetFunctionStats(b.slot);
+            continue;
+        }
+
+        states[b.slot] = b.initial;
+        shapeModes[b.slot] = SHAPE_NONE;
+        if (b.shape >= 0 && js.setFunction(b.slot, b.function)) {
+            shapeModes[b.slot] = !s.jsGlobals && js.getFunctionLength(b.slot) > 0 ? SHAPE_ARGS : SHAPE_GLOBALS;
+            js.setFunctionName(b.slot, b.device->name + "/" + (b.hasName ? b.name : toString(b.index)));
+
+            // the 'data' object the shape function sees
+            JSScopeMarker marker = js.getScopeMarker();
+            js.setData(b.slot, parseNode(js, b.data));
+            js.resetToScopeMarker(marker);
+        }
+    }
+
+    // wildcards can match other devices now
+    resolvedRoutes.clear();
+    routesResolved = 0;
+
+    active = _snapshot;
+    activeGeneration = s.generation;
+
+    if (js.cacheHits + js.cacheMisses > 0)
+        std::cout << "JS functions: " << js.cacheHits << " cached, " << js.cacheMisses << " compiled in " << js.compileTime << "ms" << std::endl;
+
+    for (size_t d = 0; d < s.sources.size(); d++)
+        if (s.sources[d].device->type == DEVICE_MIDI)
+            updateDevice(s.sources[d]);
+}
+
+// The dispatch thread owns the values and the JS heap, so whoever wants to
+// read them hands it a task. Without one, this thread stands for it
+void Context::runTask(const std::function<void()>& _task) {
+    std::unique_lock<std::mutex> lock(tasksMutex);
+
+    if (!dispatchAlive) {
+        Epoch::Guard guard;
+        const Snapshot* s = snapshot.load(std::memory_order_acquire);
+        if (s != nullptr && s != active)
+            install(s);
+        _task();
+        return;
+    }
+
+    Task task = { _task, false };
+    tasks.push_back(&task);
+    tasksPending.store(true, std::memory_order_release);
+    notifyDispatch();
+    tasksCondition.wait(lock, [&]() { return task.done; });
+}
+
+// On the dispatch thread, which takes no more of them if it's _exiting
+void Context::runTasks(bool _exiting) {
+    std::lock_guard<std::mutex> lock(tasksMutex);
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i]->fnc();
+        tasks[i]->done = true;
+    }
+    tasks.clear();
+    tasksPending.store(false, std::memory_order_release);
+    if (_exiting)
+        dispatchAlive = false;
+    tasksCondition.notify_all();
+}
+
+// Collect the JS garbage in the gaps between events and pulses, when something
+// was allocated since the last time, instead of whenever Duktape decides. The
+// snapshots (and devices) the last reloads retired are freed here too
+void Context::idleGc() {
+    Epoch::collect();
+
+    if (!jsGcIdle)
+        return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration quiet = now.time_since_epoch() - std::chrono::steady_clock::duration(lastEvent.load(std::memory_order_relaxed));
+    if (quiet < std::chrono::milliseconds(JS_GC_QUIET) || now - lastGc < std::chrono::milliseconds(jsGcInterval))
+        return;
+
+    if (js.getAllocCount() == lastGcAllocs)
+        return;
+
+    js.gc();
+    lastGc = std::chrono::steady_clock::now();
+    lastGcAllocs = js.getAllocCount();
+}
+
+void Context::printStats() {
+    // the JS counters belong to the dispatch thread
+    std::ostringstream jsStats;
+    runTask([&]() {
+        jsStats << "JS cache (" << (js.getCacheFolder().empty() ? "off" : js.getCacheFolder()) << "): " 
+                << js.cacheHits << " hits, " 
+                << js.cacheMisses << " misses, " 
+                << js.compileTime << "ms loading" << std::endl;
+
+        const JSAllocator& heap = js.getAllocator();
+        jsStats << "JS heap: " << heap.inUse << " bytes in use (peak " << heap.peak << ", " << heap.reserved << " on pools), "
+                << heap.allocs << " allocs (" << heap.pooled << " pooled, " << heap.large << " malloc), "
+                << heap.frees << " frees, " << heap.reallocs << " reallocs, "
+                << js.gcCount << " gc (" << (js.gcCount > 0 ? js.gcTime / js.gcCount : 0.0) << "ms avg)" << std::endl;
+
+        if (active == nullptr)
+            return;
+
+        const std::vector<JSFunctionStats>& fncStats = js.getFunctionStats();
+        for (size_t i = 0; i < active->bindings.size(); i++) {
+            const Binding& b = active->bindings[i];
+            if (b.shape < 0 || shapeModes[b.slot] == SHAPE_NONE || b.slot >= fncStats.size())
+                continue;
+
+            const JSFunctionStats& f = fncStats[b.slot];
+            if (f.calls == 0)
+                continue;
+
+            jsStats << "shape " << f.name << ": " 
+                    << f.calls << " calls, " 
+                    << f.totalTime / f.calls << "ms avg, " 
+                    << f.maxTime << "ms max, " 
+                    << f.timeouts << " timeouts" 
+                    << (f.disabled ? " (disabled)" : "") << std::endl;
+        }
+    });
+
+    // the devices and outputs of the last snapshot stay while it's read
+    Epoch::Guard guard;
+    const Snapshot* s = snapshot.load(std::memory_order_acquire);
+    if (s == nullptr)
+        return;
+
+    for (size_t d = 0; d < s->sources.size(); d++) {
+        const Device* device = s->sources[d].device;
+        if (device->type != DEVICE_MIDI)
+            continue;
+
+        const EventQueue& q = device->queue;
+        std::cout << device->name << " queue (" << toString(q.policy) << "): " 
+                    << q.size() << "/" << q.capacity() << " queued, "
+                    << q.pushed << " pushed, "
+                    << q.dropped << " dropped, " 
+                    << q.coalesced << " coalesced, "
+                    << q.blocked << " blocked" << std::endl;
+    }
+
+    for (std::map<std::string, Sender*>::const_iterator it = s->senders.begin(); it != s->senders.end(); it++) {
+        std::cout << it->first << " socket: " << it->second->sent << " sent, " 
+                    << it->second->bundles << " bundles, " 
+                    << it->second->batches << " batches, " 
+                    << it->second->errors << " errors" << std::endl;
+
+        if (it->second->isAsync())
+            std::cout << it->first << " queue (" << toString(it->second->policy) << "): " 
+                        << it->second->depth() << " queued, " 
+                        << it->second->maxDepth << " max, " 
+                        << it->second->queued << " pushed, " 
+                        << it->second->dropped << " dropped, " 
+                        << it->second->coalesced << " coalesced" << std::endl;
+    }
+
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    {
+        std::lock_guard<std::mutex> lock(clockMutex);
+        if (clockMaster) {
+            size_t ticks = clockMaster->ticks.load(std::memory_order_relaxed);
+            std::cout << "clock out: " << clockMaster->getBpm() << " bpm, "
+                        << (clockMaster->isPlaying() ? "playing" : "stopped") << ", "
+                        << (clockMaster->isRealtime() ? "real time" : "normal") << " priority, "
+                        << ticks << " ticks, "
+                        << (ticks > 0 ? clockMaster->jitterTotal.load(std::memory_order_relaxed) / ticks : 0.0) << "us avg jitter, "
+                        << clockMaster->jitterMax.load(std::memory_order_relaxed) << "us max, "
+                        << clockMaster->overruns.load(std::memory_order_relaxed) << " overruns" << std::endl;
+        }
+    }
+
+    for (size_t d = 0; d < s->sources.size(); d++) {
+        if (s->sources[d].device->type != DEVICE_MIDI)
+            continue;
+
+        const MidiDevice* device = (const MidiDevice*)s->sources[d].device;
+        const ClockFollower& c = device->clock;
+        ClockStats stats = c.getStats();
+        if (stats.ticks == 0)
+            continue;
+
+        double beat = c.getPosition(now) / CLOCK_PPQN;
+        size_t filtered = stats.ticks - stats.resyncs;
+        std::cout << device->name << " clock: " << c.getBpm() << " bpm, "
+                    << (c.isRunning(now) ? "running" : "stopped") << " at beat " << beat
+                    << " (bar " << size_t(beat / c.beatsPerBar) + 1 << "), "
+                    << stats.ticks << " ticks, "
+                    << (filtered > 0 ? stats.jitterTotal / filtered : 0.0) << "us avg jitter, "
+                    << stats.jitterMax << "us max, "
+                    << stats.resyncs << " resyncs" << std::endl;
+    }
+
+    for (size_t d = 0; d < s->sources.size(); d++) {
+        if (s->sources[d].device->type != DEVICE_PULSE)
+            continue;
+
+        Pulse* p = (Pulse*)s->sources[d].device;
+        std::cout << "pulse " << p->name << ": ";
+        if (p->isSynced())
+            std::cout << p->getDivision() << " per beat, ";
+        else
+            std::cout << p->getPeriodMicros() << "us period, ";
+        size_t ticks = p->ticks.load(std::memory_order_relaxed);
+        std::cout << ticks << " ticks, "
+                    << (ticks > 0 ? p->jitterTotal.load(std::memory_order_relaxed) / ticks : 0.0) << "us avg jitter, "
+                    << p->jitterMax.load(std::memory_order_relaxed) << "us max, "
+                    << p->overruns.load(std::memory_order_relaxed) << " overruns" << std::endl;
+    }
+
+    std::cout << jsStats.str();
+
+    for (std::map<std::string, FileWriter*>::const_iterator it = s->writers.begin(); it != s->writers.end(); it++)
+        std::cout << it->first << " file: " << it->second->lines << " lines, " 
+                    << it->second->writes << " writes, " 
+                    << it->second->dropped << " dropped, " 
+                    << it->second->errors << " errors" << std::endl;
+}
@@ -7,30 +7,121 @@
 #include <cstring>
 #include <string>
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 
 #include "rtmidi/RtMidi.h"
 
 #include "Pulse.h"
+#include "Scheduler.h"
+#include "ClockMaster.h"
+#include "Binding.h"
+#include "Sender.h"
+#include "FileWriter.h"
 #include "MidiDevice.h"
 #include "ops/nodes.h"
 
-enum DataType {
-    TYPE_UNKNOWN,
-
-    TYPE_BUTTON,
-    TYPE_TOGGLE,
-    
-    TYPE_NUMBER,
-    
-    TYPE_VECTOR,
-    TYPE_COLOR,
-    
-    TYPE_STRING,
-
-    TYPE_MIDI_NOTE,
-    TYPE_MIDI_CONTROLLER_CHANGE,
-    TYPE_MIDI_TIMING_TICK
+// Milliseconds without events before the dispatch thread runs the JS GC
+#define JS_GC_QUIET 2
+
+// Keys resolved through wildcards (or not found) that are remembered
+#define ROUTE_CACHE 1024
+
+// Where the values under a key of an object returned by a shape function go
+enum RouteType {
+    ROUTE_TARGET,       // trigger on a MIDI out device
+    ROUTE_LISTEN,       // map on the bindings of a listen device
+    ROUTE_FEEDBACK      // send back to a listen device (ex: LEDs)
+};
+
+struct Route {
+    RouteType       type;
+    Device*         device;
+    unsigned char   status;
+    size_t          source;     // of the device on Snapshot::sources (ROUTE_LISTEN)
+};
+typedef std::vector<Route> Routes;
+
+// A pulse to start (or restart) once the new bindings are published
+struct PulseStart {
+    Pulse*          pulse;
+    double          period;     // microseconds, or
+    ClockFollower*  clock;      // to follow
+    double          division;
+};
+
+// What a reload kept and what it had to build again
+struct ReloadStats {
+    size_t          bindingsKept = 0;
+    size_t          bindingsBuilt = 0;
+    size_t          portsKept = 0;
+    size_t          portsOpened = 0;
+    size_t          portsClosed = 0;
+    size_t          pulsesKept = 0;
+    size_t          pulsesStarted = 0;
+    size_t          pulsesRestarted = 0;    // kept, but following another clock
+    size_t          pulsesStopped = 0;
+    size_t          outputsKept = 0;
+    size_t          outputsOpened = 0;
+    size_t          outputsClosed = 0;
+    bool            globalReset = false;    // the 'global' node changed
+};
+
+// Routes of each device name (which can have wildcards, ex: Client-*)
+struct RouteName {
+    std::string     name;
+    std::string     suffix;     // "" or "/STATUS"
+    Routes          routes;
+};
+
+// A device events come from (a MIDI input or a pulse) and the binding of
+// each of its keys and statuses
+struct Source {
+    Device*         device;
+    Device::Table   table;
+};
+
+// What the shape functions of a slot turned out to be, once compiled
+enum ShapeMode {
+    SHAPE_NONE,         // no function, or it didn't compile
+    SHAPE_GLOBALS,      // function(), reads the event from globals
+    SHAPE_ARGS          // function(value, key, channel, status, device, data)
+};
+
+// Everything the events are processed with, built by load() or reload() and
+// never modified once published. The dispatch thread reads the last one
+// without locks, the one it replaces is freed once it's done with it (see
+// Epoch). What changes with the events (the values of the bindings and the
+// JS heap) belongs to the dispatch thread instead.
+struct Snapshot {
+    uint64_t                            generation = 0;
+    YAML::Node                          config;
+
+    std::vector<Binding>                bindings;
+    std::vector<Source>                 sources;
+    std::map<std::string, Sender*>      senders;
+    std::map<std::string, FileWriter*>  writers;
+
+    std::unordered_map<std::string, Routes> routes;
+    std::vector<RouteName>              routeNames;
+    std::unordered_map<std::string, std::vector<size_t> > bindingNames;
+    size_t                              slots = 0;      // of the bindings' values and JS functions
+
+    // JS settings, applied by the dispatch thread
+    bool                                jsGlobals = false;
+    std::string                         jsCache;
+    float                               jsTimeout = 20.0f;
+    size_t                              jsStrikes = 3;
+    bool                                jsGcIdle = true;
+    size_t                              jsGcInterval = 1000;
+    YAML::Node                          global;         // copy of the 'global' node
+    uint64_t                            globalBorn = 0; // generation it last changed on
 };
 
 class Context {
@@ -40,30 +131,54 @@ public:
     virtual ~Context();
 
     bool load(const std::string& _filename);
+
+    // Loads the file again keeping what didn't change: open MIDI ports,
+    // sockets, running pulses and unchanged bindings (with their values).
+    // Events keep going through the last bindings while it happens
+    bool reload(const std::string& _filename);
     bool save(const std::string& _filename);
     bool close();
 
-    bool        updateDevice(const std::string& _device);
+    // What follows runs on the dispatch thread (or the one calling simulate)
+
+    bool        updateDevice(const Source& _source);
 
     // STATUS ONLY EVENTS
-    bool        doStatusExist(const std::string& _device, unsigned char _status);
-    YAML::Node  getStatusNode(const std::string& _device, unsigned char _status);
+    const Binding* getStatusBinding(const Device::Table& _table, unsigned char _status);
 
     // KEYS EVENTS 
-    bool        doKeyExist(const std::string& _device, size_t _channel, size_t _key);
-    YAML::Node  getKeyNode(const std::string& _device, size_t _channel, size_t _key);
+    const Binding* getKeyBinding(const Device::Table& _table, size_t _channel, size_t _key);
 
     // Common Proces
-    DataType    getKeyDataType(YAML::Node _node);
-    std::vector<Target> getTargetsForNode(YAML::Node _node);
+    bool        processEvent(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float _value);
+    bool        shapeValue(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float* _value);
+    bool        mapValue(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key, float _value);
+
+    bool        updateNode(const Binding& _binding, Device* _device, unsigned char _status, size_t _channel, size_t _key);
+
+    bool        feedback(Device* _device, unsigned char _status, size_t _channel, size_t _key, size_t _value);
 
-    bool        processEvent(YAML::Node _node, const std::string& _device, unsigned char _status, size_t _channel, size_t _key, float _value, bool _statusOnly);
-    bool        shapeValue(YAML::Node _node, const std::string& _device, unsigned char _status, size_t _channel, size_t _key, float* _value, bool _statusOnly);
-    bool        mapValue(YAML::Node _node, const std::string& _device, unsigned char _status, size_t _channel, size_t _key, float _value);
+    // DISPATCH of the events queued by the MIDI callbacks
+    void        startDispatch();
+    void        stopDispatch();
+    void        notifyDispatch();
 
-    bool        updateNode(YAML::Node _node, const std::string& _device, unsigned char _status, size_t _channel, size_t _key);
+    void        printStats();
 
-    bool        feedback(const std::string& _device, unsigned char _status, size_t _channel, size_t _key, size_t _value);
+    // With the virtual clock: runs the pulses and the messages of a replay
+    // file (if any) for '_seconds' of virtual time, as fast as possible
+    bool        simulate(double _seconds, const std::string& _replay = "");
+
+    // Controls the MIDI clock master, if there is one
+    bool        transport(const std::string& _command, double _value = 0.0);
+
+    // What follows is set by load() and reload(), on their thread
+
+    size_t                              queueSize;
+    QueuePolicy                         queuePolicy;
+    std::vector<MidiDevice*>            inputDevices;
+    size_t                              clockBeats;         // per bar
+    ClockMaster*                        clockMaster;
 
     std::vector<std::string>            listenDevicesNames;
     std::map<std::string, Device*>      listenDevices;
@@ -72,11 +187,139 @@ public:
     std::vector<std::string>            targetsDevicesNames;
     std::map<std::string, Device*>      targetsDevices;
 
+    // Sockets shared by all the OSC/UDP targets with the same host:port
+    std::map<std::string, Sender*>      senders;
+    bool                                oscBundle;
+    size_t                              oscMtu;
+    bool                                outputAsync;
+    size_t                              outputSize;
+    SendPolicy                          outputPolicy;
+    std::map<std::string, SendPolicy>   outputPolicies;     // per sender key
+
+    // Buffered csv files, one per path
+    std::map<std::string, FileWriter*>  writers;
+    size_t                              csvBufferSize;
+    size_t                              csvInterval;
+    bool                                csvTimestamps;
+
+    // Drives all the pulses
+    Scheduler                           scheduler;
+
     YAML::Node                          config;
-    std::mutex                          configMutex;
-    bool                                safe;
+    std::atomic<bool>                   safe;       // loaded, pulses can tick
+    std::atomic<bool>                   reloading;  // bindings are being replaced
 protected:
 
+    bool        build(bool _reload = false);
+    void        publish();
+    void        startPulses();
+    size_t      addBinding(YAML::Node _node, Device* _device);
+    Sender*     getSender(const Target& _target);
+    FileWriter* getWriter(const Target& _target);
+    void        beginBatch();
+    void        endBatch();
+    void        dispatch();
+    size_t      drain();
+    void        install(const Snapshot* _snapshot);
+
+    // Runs _task on the dispatch thread and waits for it, or right away if
+    // there is none (ex: to read the values of the bindings)
+    void        runTask(const std::function<void()>& _task);
+    void        runTasks(bool _exiting = false);
+
+    void        buildRoutes();
+    void        addRoute(const std::string& _name, const std::string& _suffix, const Route& _route);
+    const Routes* getRoutes(const std::string& _key, Routes& _scratch);
+    void        route(const Route& _route, JSValue& _list, unsigned char _status);
+    bool        routeValue(const Route& _route, size_t _channel, size_t _key, float _value, unsigned char _status);
+
+    // emit(), feedback() and send() on the shape functions
+    static duk_ret_t jsEmit(duk_context* _ctx);
+    static duk_ret_t jsFeedback(duk_context* _ctx);
+    static duk_ret_t jsSend(duk_context* _ctx);
+    static duk_ret_t jsClock(duk_context* _ctx);
+    static duk_ret_t jsTransport(duk_context* _ctx);
+
+    MidiDevice* getClockDevice(const std::string& _pattern);
+    MidiDevice* getClockOutDevice(const std::string& _pattern);
+
+    // Load, reload, close and save one at a time (reload can close and load)
+    std::recursive_mutex                buildMutex;
+
+    // The one the events go through, and the one build() is filling
+    std::atomic<Snapshot*>              snapshot;
+    Snapshot*                           building;
+    uint64_t                            generations;
+
+    // What the last config had, waiting for build() to take it again
+    MidiDevice* takeSpareInput(const std::string& _pattern);
+    MidiDevice* takeSpareOutput(const std::string& _name);
+    Pulse*      takeSparePulse(const std::string& _name);
+    Binding*    takeSpareBinding(YAML::Node _node, Device* _device, const std::string& _source);
+    std::map<std::string, MidiDevice*>  spareInputs;
+    std::map<std::string, MidiDevice*>  spareOutputs;
+    std::map<std::string, Pulse*>       sparePulses;
+    std::vector<Binding>                spareBindings;
+    std::vector<bool>                   spareBindingsTaken;
+    std::unordered_map<std::string, std::vector<size_t> > spareBindingIds;  // bindingId() -> spareBindings
+    bool                                reuseBindings;
+    bool                                keepGlobal;
+
+    // Slots of the values and the shape functions (and their data) of the
+    // bindings. Kept bindings hold on to theirs, so they aren't their position
+    size_t      takeSlot();
+    std::vector<size_t>                 freeSlots;
+    size_t                              slots;
+    std::vector<PulseStart>             pulseStarts;
+    ReloadStats                         reloadStats;
+
+    const std::vector<std::string>& getMidiInPorts();
+    const std::vector<std::string>& getMidiOutPorts();
+    std::vector<std::string>            midiInPorts;
+    std::vector<std::string>            midiOutPorts;
+    bool                                midiPortsListed;
+
+    // The clock master, changed by load() and close()
+    std::mutex                          clockMutex;
+
+    // What follows belongs to the dispatch thread (or the one calling simulate)
+
+    // The snapshot it's on, set up the first time it sees it
+    const Snapshot*                     active;
+    uint64_t                            activeGeneration;
+    std::vector<BindingState>           states;         // per slot
+    std::vector<uint8_t>                shapeModes;     // per slot, a ShapeMode
+
     JSContext                           js;
-    std::map<std::string, size_t>       shapeFncs;
+    bool                                jsGcIdle;
+    size_t                              jsGcInterval;   // milliseconds
+    void        idleGc();
+
+    // Keys of the objects returned by shape functions, resolved through wildcards
+    std::unordered_map<std::string, Routes> resolvedRoutes;
+    size_t                              routesResolved;
+    std::string                         routeKey;
+    unsigned char                       shapeStatus;    // of the event being shaped
+
+    std::thread                         dispatchThread;
+    std::mutex                          dispatchMutex;
+    std::condition_variable             dispatchCondition;
+    std::atomic<bool>                   dispatchPending;
+    std::atomic<bool>                   dispatching;
+
+    // Waiting for the dispatch thread (see runTask)
+    struct Task {
+        std::function<void()>           fnc;
+        bool                            done;
+    };
+    std::vector<Task*>                  tasks;
+    std::mutex                          tasksMutex;
+    std::condition_variable             tasksCondition;
+    std::atomic<bool>                   tasksPending;
+    bool                                dispatchAlive;  // takes tasks, under tasksMutex
+
+    // Last time an event or pulse was processed, for the idle GC
+    std::atomic<int64_t>                lastEvent;
+    std::chrono::steady_clock::time_point   lastGc;
+    size_t                              lastGcAllocs;
 };
@@ -1,6 +1,11 @@
 #pragma once
 
-#include <map>
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+#include "Epoch.h"
+#include "EventQueue.h"
 
 enum DeviceType {
     DEVICE_PULSE,
@@ -10,53 +15,114 @@ enum DeviceType {
 class Device {
 public:
 
+    // 16 MIDI channels plus channel 0, which listen to all of them (omni)
+    static const size_t         CHANNELS = 17;
+    static const size_t         KEYS = 128;
+    static const size_t         STATUSES = 256;
+
+    // Binding of every key and status (its position on the Context's
+    // Snapshot), -1 for none. The one events read is never modified:
+    // bindings are set on a copy that replaces it at once (publishFncs), so
+    // it can be read without a lock inside an Epoch::Guard
+    struct Table {
+        Table() {
+            for (size_t c = 0; c < CHANNELS; c++)
+                for (size_t k = 0; k < KEYS; k++)
+                    keys[c][k] = -1;
+
+            for (size_t s = 0; s < STATUSES; s++)
+                statuses[s] = -1;
+        }
+
+        int32_t                 keys[CHANNELS][KEYS];
+        int32_t                 statuses[STATUSES];
+    };
+
+    Device() : table(new Table()), building(nullptr) {
+    }
+
+    ~Device() {
+        delete table.load();
+        delete building;
+    }
+
     std::string                 name;
     DeviceType                  type;
 
+    // Events waiting for the dispatch thread (MIDI messages or pulse ticks)
+    EventQueue                  queue;
+
+    // Forget all the bindings (ex: to set them again on reload)
+    void                        clearFncs() {
+        delete building;
+        building = new Table();
+    }
+
+    // The bindings set since the last publishFncs(), or the published ones
+    const Table&                getFncs() const {
+        return building ? *building : *table.load();
+    }
+
+    // Makes the bindings set since the last time visible to the events
+    void                        publishFncs() {
+        if (building == nullptr)
+            return;
+
+        Table* old = table.exchange(building);
+        building = nullptr;
+        Epoch::retire(old, [](void* _table) { delete (Table*)_table; });
+    }
+
     // KEYS EVENTS
     void                        setKeyFnc(size_t _channel, size_t _key, size_t _fnc) {
-        size_t offset = _channel * 127;
-        keyMap[offset + _key] = _fnc;
-    }
+        if (_channel >= CHANNELS || _key >= KEYS)
+            return;
+
+        Table& t = edit();
 
-    bool                        isKeyFnc(size_t _channel, size_t _key) {
-        // Channel 0 replay to all 
-        //
-        if (keyMap.find(_key) != keyMap.end())
-            return true;
-        
-        size_t offset = _channel * 127;
-        return keyMap.find(offset + _key) != keyMap.end();
+        // Channel 0 have precedent over channel specific, so it's
+        // copied to every channel and a lookup is a single load
+        if (_channel == 0) {
+            for (size_t c = 0; c < CHANNELS; c++)
+                t.keys[c][_key] = (int32_t)_fnc;
+        }
+        else if (t.keys[0][_key] < 0)
+            t.keys[_channel][_key] = (int32_t)_fnc;
     }
 
-    size_t                      getKeyFnc(size_t _channel, size_t _key) {
-        // Channel 0 have precedent over channel specific
-        //
-        if (keyMap.find(_key) != keyMap.end())
-            return keyMap[_key];
+    bool                        isKeyFnc(size_t _channel, size_t _key) const {
+        return getKeyFnc(_channel, _key) >= 0;
+    }
 
-        size_t offset = size_t(_channel) * 127;
-        return keyMap[offset + _key];
+    int32_t                     getKeyFnc(size_t _channel, size_t _key) const {
+        if (_channel >= CHANNELS || _key >= KEYS)
+            return -1;
+        return table.load()->keys[_channel][_key];
     }
 
 
     // STATUS ONLY EVENTS
     void                        setStatusFnc(unsigned char _status, size_t _fnc) {
-        statusMap[_status] = _fnc;
+        edit().statuses[_status] = (int32_t)_fnc;
     }
 
-    bool                        isStatusFnc(unsigned char _status) {
-        if (statusMap.find(_status) == statusMap.end())
-            return false;
-        return true;
+    bool                        isStatusFnc(unsigned char _status) const {
+        return getStatusFnc(_status) >= 0;
     }
 
-    size_t                      getStatusFnc(unsigned char _status) {
-        return statusMap[_status];
+    int32_t                     getStatusFnc(unsigned char _status) const {
+        return table.load()->statuses[_status];
     }
 
 protected:
-    std::map<size_t, size_t>            keyMap;
-    std::map<unsigned char, size_t>     statusMap;
-    void*                               ctx;
+    // the copy being set, starting from the current one
+    Table&                      edit() {
+        if (building == nullptr)
+            building = new Table(*table.load());
+        return *building;
+    }
+
+    std::atomic<Table*>         table;
+    Table*                      building;
+    void*                       ctx;
 };
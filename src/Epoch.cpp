@@ -0,0 +1,109 @@
+#include "Epoch.h"
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+struct Retired {
+    void*       ptr;
+    void        (*free)(void*);
+    uint64_t    epoch;
+};
+
+static std::atomic<uint64_t>    current(1);
+static std::atomic<uint64_t>    slots[EPOCH_SLOTS];     // 0 when the thread isn't reading
+static std::atomic<bool>        claimed[EPOCH_SLOTS];   // taken by a live thread
+static std::atomic<size_t>      overflow(0);            // readers without a slot
+
+static std::mutex               retiredMutex;
+static std::vector<Retired>     retired;
+
+// The slot of each thread, given back when the thread exits so threads
+// that come and go (ex: MIDI ports opened on every reload) don't use them up
+struct Slot {
+    int         index = -1;     // EPOCH_SLOTS when all were taken
+
+    bool        claim() {
+        for (size_t i = 0; i < EPOCH_SLOTS; i++) {
+            bool expected = false;
+            if (claimed[i].compare_exchange_strong(expected, true)) {
+                index = int(i);
+                return true;
+            }
+        }
+        index = EPOCH_SLOTS;
+        return false;
+    }
+
+    ~Slot() {
+        if (index >= 0 && index < EPOCH_SLOTS) {
+            slots[index].store(0);
+            claimed[index].store(false);
+        }
+    }
+};
+
+static thread_local Slot        slot;
+static thread_local size_t      depth = 0;
+
+Epoch::Guard::Guard() {
+    if (depth++ > 0)
+        return;
+
+    // without one yet, or all were taken last time
+    if (slot.index < 0 || slot.index == EPOCH_SLOTS)
+        slot.claim();
+
+    if (slot.index < EPOCH_SLOTS)
+        slots[slot.index].store(current.load());
+    else
+        overflow++;
+}
+
+Epoch::Guard::~Guard() {
+    if (--depth > 0)
+        return;
+
+    if (slot.index < EPOCH_SLOTS)
+        slots[slot.index].store(0);
+    else
+        overflow--;
+}
+
+void Epoch::retire(void* _ptr, void (*_free)(void*)) {
+    if (_ptr == nullptr)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        Retired r = { _ptr, _free, current.fetch_add(1) };
+        retired.push_back(r);
+    }
+    collect();
+}
+
+size_t Epoch::collect() {
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    if (overflow.load() > 0)
+        return retired.size();
+
+    // the oldest epoch a reader is still in
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < EPOCH_SLOTS; i++) {
+        uint64_t e = slots[i].load();
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+
+    // readers that entered after something was retired can't have seen it
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        if (retired[i].epoch < oldest)
+            retired[i].free(retired[i].ptr);
+        else
+            retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+    return kept;
+}
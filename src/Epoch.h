@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+// Live threads that can have a reader slot of their own (given back when
+// they exit), the rest share one counter that holds everything back while
+// they read
+#define EPOCH_SLOTS 64
+
+// Epoch based reclamation for what is read without a lock (ex: the binding
+// tables of the devices, read from the MIDI callbacks). A writer swaps the
+// pointer and retires the old object, which is freed once every reader that
+// could have loaded it has left its Guard.
+//
+class Epoch {
+public:
+
+    // Keep one alive while using a pointer loaded inside it
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+    };
+
+    static void     retire(void* _ptr, void (*_free)(void*));
+
+    // Frees what no reader can see anymore, returns how many are left
+    static size_t   collect();
+};
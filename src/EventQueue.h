@@ -0,0 +1,257 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// Fixed size event decoded on the RtMidi callback thread and handed
+// to the dispatch thread.
+//
+struct MidiEvent {
+    uint64_t        timestamp = 0;  // steady clock, microseconds
+    uint32_t        device = 0;
+    unsigned char   status = 0;
+    unsigned char   channel = 0;
+    unsigned char   key = 0;
+    unsigned char   value = 0;
+};
+
+// Longest the block policy holds the MIDI callback
+#define QUEUE_BLOCK_WAIT_US 1000
+
+// What to do when the queue is full
+//
+enum QueuePolicy {
+    QUEUE_DROP_OLDEST,  // overwrite the oldest queued event
+    QUEUE_DROP_NEWEST,  // discard the incoming event
+    QUEUE_BLOCK,        // wait a little for the dispatch thread to make room, then drop
+    QUEUE_COALESCE      // keep only the last value per status/channel/key
+};
+
+inline QueuePolicy toQueuePolicy(const std::string& _string) {
+    if (_string == "drop_newest")
+        return QUEUE_DROP_NEWEST;
+    else if (_string == "block")
+        return QUEUE_BLOCK;
+    else if (_string == "coalesce")
+        return QUEUE_COALESCE;
+    return QUEUE_DROP_OLDEST;
+}
+
+inline std::string toString(QueuePolicy _policy) {
+    if (_policy == QUEUE_DROP_NEWEST)
+        return "drop_newest";
+    else if (_policy == QUEUE_BLOCK)
+        return "block";
+    else if (_policy == QUEUE_COALESCE)
+        return "coalesce";
+    return "drop_oldest";
+}
+
+// Single producer (RtMidi callback) / single consumer (dispatch thread) ring buffer.
+// Indices grow monotonically and are wrapped with a power of two mask. Only the
+// producer moves head and only the consumer moves tail.
+//
+// Under drop_oldest the producer doesn't wait for room: it overwrites the
+// oldest slot. Each slot carries the index it was written for (a seqlock,
+// with the event stored in atomic words), so the consumer notices a slot
+// that was overwritten before or while it read it and skips it.
+//
+class EventQueue {
+public:
+
+    EventQueue() : head(0), tail(0), pushed(0), dropped(0), coalesced(0), blocked(0), pending(false) { }
+
+    void    allocate(size_t _size, QueuePolicy _policy) {
+        size_t capacity = 2;
+        while (capacity < _size)
+            capacity <<= 1;
+
+        mask = capacity - 1;
+        policy = _policy;
+        slots.reset(new Slot[capacity]());
+
+        if (policy == QUEUE_COALESCE)
+            latest.reset(new std::atomic<uint16_t>[COALESCE_SLOTS]());
+    }
+
+    size_t  capacity() const { return mask + 1; }
+    size_t  size() const {
+        size_t s = head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+        return s > mask ? mask + 1 : s;
+    }
+
+    // Producer side
+    bool    push(const MidiEvent& _event) {
+        pushed.fetch_add(1, std::memory_order_relaxed);
+
+        // channel messages waiting on the coalesce table keep going there,
+        // so they are never dispatched out of order
+        if (policy == QUEUE_COALESCE && isChannelMessage(_event.status) && pending.load(std::memory_order_acquire)) {
+            coalesce(_event);
+            return true;
+        }
+
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+
+        if (h - t > mask) {
+            if (policy == QUEUE_DROP_OLDEST) {
+                // the consumer skips the overwritten slot when it gets there
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                write(h, _event);
+                return true;
+            }
+
+            if (policy == QUEUE_COALESCE) {
+                if (isChannelMessage(_event.status))
+                    coalesce(_event);
+                else
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            if (policy == QUEUE_BLOCK) {
+                // Never hold the MIDI callback for long: the dispatch thread
+                // may be paused (ex: while everything is reloaded)
+                blocked.fetch_add(1, std::memory_order_relaxed);
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(QUEUE_BLOCK_WAIT_US);
+                while (h - tail.load(std::memory_order_acquire) > mask && std::chrono::steady_clock::now() < deadline)
+                    std::this_thread::yield();
+            }
+
+            // The slots already queued belong to the consumer, drop the new one
+            if (h - tail.load(std::memory_order_acquire) > mask) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        write(h, _event);
+        return true;
+    }
+
+    // Consumer side
+    bool    pop(MidiEvent& _event) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+
+        while (t != h) {
+            // the producer lapped us, everything older than a ring is gone
+            if (h - t > mask)
+                t = h - mask - 1;
+
+            if (read(t, _event)) {
+                tail.store(t + 1, std::memory_order_release);
+                return true;
+            }
+
+            // overwritten by a newer event, which comes later in the ring
+            t++;
+            h = head.load(std::memory_order_acquire);
+        }
+
+        tail.store(t, std::memory_order_release);
+        return false;
+    }
+
+    // Consumer side. Call once the ring is empty to flush the coalesced values
+    template <typename F>
+    size_t  popCoalesced(uint32_t _device, uint64_t _timestamp, F _fnc) {
+        if (policy != QUEUE_COALESCE || !pending.exchange(false, std::memory_order_acq_rel))
+            return 0;
+
+        size_t total = 0;
+        for (size_t i = 0; i < COALESCE_SLOTS; i++) {
+            uint16_t v = latest[i].exchange(0, std::memory_order_acq_rel);
+            if (v == 0)
+                continue;
+
+            MidiEvent event;
+            event.timestamp = _timestamp;
+            event.device = _device;
+            event.status = 0x80 + (unsigned char)((i >> 11) << 4);
+            event.channel = ((i >> 7) & 0x0F) + 1;
+            event.key = i & 0x7F;
+            event.value = (unsigned char)(v - 1);
+            _fnc(event);
+            total++;
+        }
+        return total;
+    }
+
+    std::atomic<size_t>         head;
+    std::atomic<size_t>         tail;
+
+    // Overflow counters
+    std::atomic<size_t>         pushed;
+    std::atomic<size_t>         dropped;
+    std::atomic<size_t>         coalesced;
+    std::atomic<size_t>         blocked;
+
+    QueuePolicy                 policy = QUEUE_DROP_OLDEST;
+
+private:
+
+    // NOTE_OFF (0x80) to PITCH_BEND (0xE0) x 16 channels (1~16) x 128 keys
+    static const size_t         COALESCE_SLOTS = 7 * 16 * 128;
+
+    static bool isChannelMessage(unsigned char _status) { return _status >= 0x80 && _status < 0xF0; }
+
+    struct Slot {
+        std::atomic<uint64_t>   seq;    // 2 * index + 2 once written, odd while writing
+        std::atomic<uint64_t>   timestamp;
+        std::atomic<uint64_t>   data;   // device, status, channel, key and value
+    };
+
+    void    write(size_t _index, const MidiEvent& _event) {
+        Slot& s = slots[_index & mask];
+        s.seq.store(2 * uint64_t(_index) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        s.timestamp.store(_event.timestamp, std::memory_order_relaxed);
+        s.data.store((uint64_t(_event.device) << 32) | (uint64_t(_event.status) << 24) | 
+                     (uint64_t(_event.channel) << 16) | (uint64_t(_event.key) << 8) | _event.value, 
+                     std::memory_order_relaxed);
+
+        s.seq.store(2 * uint64_t(_index) + 2, std::memory_order_release);
+        head.store(_index + 1, std::memory_order_release);
+    }
+
+    // false if the slot doesn't hold _index anymore
+    bool    read(size_t _index, MidiEvent& _event) const {
+        const Slot& s = slots[_index & mask];
+        uint64_t seq = 2 * uint64_t(_index) + 2;
+        if (s.seq.load(std::memory_order_acquire) != seq)
+            return false;
+
+        uint64_t timestamp = s.timestamp.load(std::memory_order_relaxed);
+        uint64_t data = s.data.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) != seq)
+            return false;
+
+        _event.timestamp = timestamp;
+        _event.device = uint32_t(data >> 32);
+        _event.status = (unsigned char)(data >> 24);
+        _event.channel = (unsigned char)(data >> 16);
+        _event.key = (unsigned char)(data >> 8);
+        _event.value = (unsigned char)data;
+        return true;
+    }
+
+    void    coalesce(const MidiEvent& _event) {
+        size_t index = ((size_t)((_event.status >> 4) - 8) << 11) | ((size_t)((_event.channel - 1) & 0x0F) << 7) | (_event.key & 0x7F);
+        if (latest[index].exchange(_event.value + 1, std::memory_order_acq_rel) != 0)
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+        pending.store(true, std::memory_order_release);
+    }
+
+    std::unique_ptr<Slot[]>                 slots;
+    std::unique_ptr<std::atomic<uint16_t>[]> latest;
+    std::atomic<bool>                       pending;
+    size_t                                  mask = 0;
+};
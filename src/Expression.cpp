@@ -0,0 +1,359 @@
+#include "Expression.h"
+
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+bool Expression::compile(const std::string& _source) {
+    source = _source;
+    error.clear();
+    code.clear();
+    globals.clear();
+    filter = false;
+    pos = 0;
+    depth = 0;
+    maxDepth = 0;
+    nesting = 0;
+    lastIsLogic = false;
+
+    if (!parseTernary())
+        return false;
+
+    skipSpaces();
+    if (pos != source.size())
+        return fail("unexpected '" + source.substr(pos, 1) + "'");
+
+    if (maxDepth > EXPRESSION_STACK)
+        return fail("too complex");
+
+    filter = lastIsLogic;
+    return true;
+}
+
+void Expression::skipSpaces() {
+    while (pos < source.size() && isspace((unsigned char)source[pos]))
+        pos++;
+}
+
+bool Expression::match(const char* _token) {
+    skipSpaces();
+    size_t size = strlen(_token);
+    if (source.compare(pos, size, _token) != 0)
+        return false;
+
+    // don't take the first half of '<=', '==', '!=', '&&' or '||'
+    if (size == 1 && pos + 1 < source.size()) {
+        char next = source[pos + 1];
+        if ((_token[0] == '<' || _token[0] == '>' || _token[0] == '!') && next == '=')
+            return false;
+    }
+
+    pos += size;
+    return true;
+}
+
+bool Expression::fail(const std::string& _error) {
+    error = _error + " at " + std::to_string(pos) + " in '" + source + "'";
+    code.clear();
+    return false;
+}
+
+void Expression::emit(OpCode _op, float _arg, int _stack) {
+    Instruction i;
+    i.op = _op;
+    i.arg = _arg;
+    code.push_back(i);
+
+    depth += _stack;
+    maxDepth = std::max(maxDepth, depth);
+
+    lastIsLogic = _op == OP_NOT || (_op >= OP_LT && _op <= OP_OR);
+}
+
+bool Expression::parseTernary() {
+    // parenthesis and function arguments come back here, keep the C++ stack bounded
+    if (++nesting > EXPRESSION_NESTING)
+        return fail("too deeply nested");
+
+    if (!parseOr())
+        return false;
+
+    if (match("?")) {
+        if (!parseTernary())
+            return false;
+        if (!match(":"))
+            return fail("expected ':'");
+        if (!parseTernary())
+            return false;
+        emit(OP_SELECT, 0.0f, -2);
+    }
+
+    nesting--;
+    return true;
+}
+
+bool Expression::parseOr() {
+    if (!parseAnd())
+        return false;
+
+    while (match("||")) {
+        if (!parseAnd())
+            return false;
+        emit(OP_OR, 0.0f, -1);
+    }
+    return true;
+}
+
+bool Expression::parseAnd() {
+    if (!parseEquality())
+        return false;
+
+    while (match("&&")) {
+        if (!parseEquality())
+            return false;
+        emit(OP_AND, 0.0f, -1);
+    }
+    return true;
+}
+
+bool Expression::parseEquality() {
+    if (!parseRelational())
+        return false;
+
+    while (true) {
+        OpCode op;
+        if (match("=="))        op = OP_EQ;
+        else if (match("!="))   op = OP_NE;
+        else                    return true;
+
+        if (!parseRelational())
+            return false;
+        emit(op, 0.0f, -1);
+    }
+}
+
+bool Expression::parseRelational() {
+    if (!parseAdditive())
+        return false;
+
+    while (true) {
+        OpCode op;
+        if (match("<="))        op = OP_LE;
+        else if (match(">="))   op = OP_GE;
+        else if (match("<"))    op = OP_LT;
+        else if (match(">"))    op = OP_GT;
+        else                    return true;
+
+        if (!parseAdditive())
+            return false;
+        emit(op, 0.0f, -1);
+    }
+}
+
+bool Expression::parseAdditive() {
+    if (!parseMultiplicative())
+        return false;
+
+    while (true) {
+        OpCode op;
+        if (match("+"))         op = OP_ADD;
+        else if (match("-"))    op = OP_SUB;
+        else                    return true;
+
+        if (!parseMultiplicative())
+            return false;
+        emit(op, 0.0f, -1);
+    }
+}
+
+bool Expression::parseMultiplicative() {
+    if (!parseUnary())
+        return false;
+
+    while (true) {
+        OpCode op;
+        if (match("*"))         op = OP_MUL;
+        else if (match("/"))    op = OP_DIV;
+        else if (match("%"))    op = OP_MOD;
+        else                    return true;
+
+        if (!parseUnary())
+            return false;
+        emit(op, 0.0f, -1);
+    }
+}
+
+bool Expression::parseUnary() {
+    if (++nesting > EXPRESSION_NESTING)
+        return fail("too deeply nested");
+
+    bool ok;
+    if (match("-")) {
+        ok = parseUnary();
+        if (ok)
+            emit(OP_NEG);
+    }
+    else if (match("!")) {
+        ok = parseUnary();
+        if (ok)
+            emit(OP_NOT);
+    }
+    else if (match("+"))
+        ok = parseUnary();
+    else
+        ok = parsePrimary();
+
+    nesting--;
+    return ok;
+}
+
+struct ExpressionFunction {
+    const char*         name;
+    Expression::OpCode  op;
+    int                 args;
+};
+
+static const ExpressionFunction functions[] = {
+    { "min",    Expression::OP_MIN,     2 },
+    { "max",    Expression::OP_MAX,     2 },
+    { "abs",    Expression::OP_ABS,     1 },
+    { "floor",  Expression::OP_FLOOR,   1 },
+    { "ceil",   Expression::OP_CEIL,    1 },
+    { "round",  Expression::OP_ROUND,   1 },
+    { "sqrt",   Expression::OP_SQRT,    1 },
+    { "pow",    Expression::OP_POW,     2 },
+    { "clamp",  Expression::OP_CLAMP,   3 }
+};
+
+bool Expression::parsePrimary() {
+    skipSpaces();
+    if (pos >= source.size())
+        return fail("unexpected end");
+
+    if (match("(")) {
+        if (!parseTernary())
+            return false;
+        if (!match(")"))
+            return fail("expected ')'");
+        return true;
+    }
+
+    // NUMBER
+    char c = source[pos];
+    if (isdigit((unsigned char)c) || c == '.') {
+        const char* start = source.c_str() + pos;
+        char* end = NULL;
+        float number = strtof(start, &end);
+        if (end == start)
+            return fail("bad number");
+        pos += end - start;
+        emit(OP_CONST, number, 1);
+        return true;
+    }
+
+    // NAME
+    if (!isalpha((unsigned char)c) && c != '_')
+        return fail("unexpected '" + source.substr(pos, 1) + "'");
+
+    size_t start = pos;
+    while (pos < source.size() && (isalnum((unsigned char)source[pos]) || source[pos] == '_' || source[pos] == '.'))
+        pos++;
+    std::string name = source.substr(start, pos - start);
+
+    if (name == "value")            emit(OP_VALUE, 0.0f, 1);
+    else if (name == "key")         emit(OP_KEY, 0.0f, 1);
+    else if (name == "channel")     emit(OP_CHANNEL, 0.0f, 1);
+    else if (name == "true")        emit(OP_CONST, 1.0f, 1);
+    else if (name == "false")       emit(OP_CONST, 0.0f, 1);
+    else if (name.compare(0, 7, "global.") == 0 && name.size() > 7) {
+        globals.push_back(name.substr(7));
+        emit(OP_GLOBAL, float(globals.size() - 1), 1);
+    }
+    else {
+        for (size_t f = 0; f < sizeof(functions) / sizeof(functions[0]); f++) {
+            if (name != functions[f].name)
+                continue;
+
+            if (!match("("))
+                return fail("expected '(' after " + name);
+
+            for (int a = 0; a < functions[f].args; a++) {
+                if (a > 0 && !match(","))
+                    return fail(name + " takes " + std::to_string(functions[f].args) + " arguments");
+                if (!parseTernary())
+                    return false;
+            }
+
+            if (!match(")"))
+                return fail("expected ')'");
+
+            emit(functions[f].op, 0.0f, 1 - functions[f].args);
+            return true;
+        }
+
+        return fail("unknown name '" + name + "'");
+    }
+
+    return true;
+}
+
+bool Expression::eval(JSContext& _js, float* _value, float _key, float _channel) const {
+    float stack[EXPRESSION_STACK];
+    int top = -1;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        const Instruction& in = code[i];
+
+        switch (in.op) {
+            case OP_CONST:      stack[++top] = in.arg; break;
+            case OP_VALUE:      stack[++top] = *_value; break;
+            case OP_KEY:        stack[++top] = _key; break;
+            case OP_CHANNEL:    stack[++top] = _channel; break;
+            case OP_GLOBAL: {
+                float g = 0.0f;
+                _js.getGlobalNumber("global", globals[(size_t)in.arg], &g);
+                stack[++top] = g;
+                break;
+            }
+
+            case OP_ADD:        top--; stack[top] = stack[top] + stack[top + 1]; break;
+            case OP_SUB:        top--; stack[top] = stack[top] - stack[top + 1]; break;
+            case OP_MUL:        top--; stack[top] = stack[top] * stack[top + 1]; break;
+            case OP_DIV:        top--; stack[top] = stack[top] / stack[top + 1]; break;
+            case OP_MOD:        top--; stack[top] = std::fmod(stack[top], stack[top + 1]); break;
+            case OP_NEG:        stack[top] = -stack[top]; break;
+            case OP_NOT:        stack[top] = stack[top] == 0.0f ? 1.0f : 0.0f; break;
+
+            case OP_LT:         top--; stack[top] = stack[top] <  stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_LE:         top--; stack[top] = stack[top] <= stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_GT:         top--; stack[top] = stack[top] >  stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_GE:         top--; stack[top] = stack[top] >= stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_EQ:         top--; stack[top] = stack[top] == stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_NE:         top--; stack[top] = stack[top] != stack[top + 1] ? 1.0f : 0.0f; break;
+            case OP_AND:        top--; stack[top] = (stack[top] != 0.0f && stack[top + 1] != 0.0f) ? 1.0f : 0.0f; break;
+            case OP_OR:         top--; stack[top] = (stack[top] != 0.0f || stack[top + 1] != 0.0f) ? 1.0f : 0.0f; break;
+            case OP_SELECT:     top -= 2; stack[top] = stack[top] != 0.0f ? stack[top + 1] : stack[top + 2]; break;
+
+            case OP_MIN:        top--; stack[top] = std::min(stack[top], stack[top + 1]); break;
+            case OP_MAX:        top--; stack[top] = std::max(stack[top], stack[top + 1]); break;
+            case OP_POW:        top--; stack[top] = std::pow(stack[top], stack[top + 1]); break;
+            case OP_ABS:        stack[top] = std::fabs(stack[top]); break;
+            case OP_FLOOR:      stack[top] = std::floor(stack[top]); break;
+            case OP_CEIL:       stack[top] = std::ceil(stack[top]); break;
+            case OP_ROUND:      stack[top] = std::round(stack[top]); break;
+            case OP_SQRT:       stack[top] = std::sqrt(stack[top]); break;
+            case OP_CLAMP:      top -= 2; stack[top] = std::min(std::max(stack[top], stack[top + 1]), stack[top + 2]); break;
+        }
+    }
+
+    if (top != 0)
+        return false;
+
+    if (filter)
+        return stack[0] != 0.0f;
+
+    *_value = stack[0];
+    return true;
+}
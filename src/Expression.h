@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "JSContext.h"
+
+// Maximum depth of the evaluation stack (it lives on the C++ stack)
+#define EXPRESSION_STACK 32
+
+// Maximum nesting of parenthesis, unary operators and ternaries while parsing
+#define EXPRESSION_NESTING 64
+
+// One line shape expressions like `value * 2 - 10` or `value > 64 && key < 8`,
+// compiled at load into a small stack based bytecode over numbers.
+//
+// Variables: value, key, channel and global.<name>
+// Operators: + - * / % ! < <= > >= == != && || ?: and parenthesis
+// Functions: min, max, abs, floor, ceil, round, sqrt, pow, clamp
+//
+// Evaluating one doesn't allocate. If the result is a comparison or a logic
+// operation the expression works as a filter (false stops the event),
+// otherwise the result replaces the value.
+//
+class Expression {
+public:
+
+    enum OpCode : uint8_t {
+        OP_CONST, OP_VALUE, OP_KEY, OP_CHANNEL, OP_GLOBAL,
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_NEG, OP_NOT,
+        OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR, OP_SELECT,
+        OP_MIN, OP_MAX, OP_ABS, OP_FLOOR, OP_CEIL, OP_ROUND, OP_SQRT, OP_POW, OP_CLAMP
+    };
+
+    struct Instruction {
+        OpCode  op;
+        float   arg;    // constant, or index on 'globals'
+    };
+
+    bool        compile(const std::string& _source);
+    bool        isValid() const { return !code.empty(); }
+    bool        isFilter() const { return filter; }
+
+    // Returns false if the event should stop here
+    bool        eval(JSContext& _js, float* _value, float _key, float _channel) const;
+
+    std::string source;
+    std::string error;
+
+protected:
+    // recursive descent, one function per precedence level
+    bool        parseTernary();
+    bool        parseOr();
+    bool        parseAnd();
+    bool        parseEquality();
+    bool        parseRelational();
+    bool        parseAdditive();
+    bool        parseMultiplicative();
+    bool        parseUnary();
+    bool        parsePrimary();
+
+    void        skipSpaces();
+    bool        match(const char* _token);
+    bool        fail(const std::string& _error);
+    void        emit(OpCode _op, float _arg = 0.0f, int _stack = 0);
+
+    std::vector<Instruction>    code;
+    std::vector<std::string>    globals;
+    bool                        filter = false;
+
+    // only used while compiling
+    size_t                      pos = 0;
+    int                         depth = 0;
+    int                         maxDepth = 0;
+    int                         nesting = 0;
+    bool                        lastIsLogic = false;
+};
@@ -0,0 +1,119 @@
+#include "FileWriter.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+FileWriter::FileWriter(const std::string& _filename, size_t _bufferSize, size_t _interval, bool _timestamps) :
+    filename(_filename),
+    lines(0),
+    writes(0),
+    errors(0),
+    dropped(0),
+    file(NULL),
+    bufferSize(_bufferSize),
+    interval(_interval),
+    timestamps(_timestamps),
+    running(false) {
+
+    front.reserve(bufferSize);
+    back.reserve(bufferSize);
+    start = std::chrono::steady_clock::now();
+
+    file = fopen(filename.c_str(), "a");
+    if (file == NULL) {
+        std::cout << "Failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    running = true;
+    thread = std::thread(&FileWriter::run, this);
+}
+
+FileWriter::~FileWriter() {
+    if (running) {
+        running = false;
+        condition.notify_one();
+        thread.join();
+    }
+
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+void FileWriter::write(const std::string& _line) {
+    if (file == NULL) {
+        errors++;
+        return;
+    }
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        char stamp[32];
+        int size = 0;
+        if (timestamps) {
+            // seconds since the file was opened, from a monotonic clock
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            size = snprintf(stamp, sizeof(stamp), "%.6f,", secs);
+        }
+
+        // the thread is still writing the other buffer, don't grow this one
+        if (front.size() + size + _line.size() > bufferSize) {
+            dropped++;
+            full = true;
+        }
+        else {
+            front.insert(front.end(), stamp, stamp + size);
+            front.insert(front.end(), _line.begin(), _line.end());
+            lines++;
+            full = front.size() >= bufferSize / 2;
+        }
+    }
+
+    if (full)
+        condition.notify_one();
+}
+
+// Whatever is left once the thread is stopping
+void FileWriter::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    back.swap(front);
+    front.clear();
+
+    if (!back.empty()) {
+        if (fwrite(back.data(), 1, back.size(), file) != back.size())
+            errors++;
+        fflush(file);
+        writes++;
+    }
+    back.clear();
+}
+
+void FileWriter::run() {
+    while (running) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait_for(lock, std::chrono::milliseconds(interval), [&]() { 
+                return front.size() >= bufferSize / 2 || !running; 
+            });
+
+            if (front.empty())
+                continue;
+
+            back.swap(front);
+        }
+
+        // the disk is hit without holding the lock, write() keeps filling the other buffer
+        if (fwrite(back.data(), 1, back.size(), file) != back.size())
+            errors++;
+        fflush(file);
+        writes++;
+        back.clear();
+    }
+
+    flush();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+#include <stdio.h>
+
+// Appends lines to a file from a background thread. write() only copies
+// into a preallocated buffer; the thread swaps it out and writes it when
+// it's half full or every 'interval' milliseconds, whichever comes first.
+// If the disk can't keep up, lines that don't fit in the buffer are dropped.
+//
+class FileWriter {
+public:
+
+    FileWriter(const std::string& _filename, size_t _bufferSize = 64 * 1024, size_t _interval = 250, bool _timestamps = false);
+    virtual ~FileWriter();
+
+    bool        isOpen() const { return file != NULL; }
+
+    // _line should already have its '\n'
+    void        write(const std::string& _line);
+
+    std::string filename;
+
+    std::atomic<size_t> lines;
+    std::atomic<size_t> writes;
+    std::atomic<size_t> errors;
+    std::atomic<size_t> dropped;
+
+protected:
+    void        run();
+    void        flush();
+
+    FILE*                       file;
+
+    std::vector<char>           front;      // filled by write()
+    std::vector<char>           back;       // written by the thread
+    size_t                      bufferSize;
+    size_t                      interval;
+    bool                        timestamps;
+    std::chrono::steady_clock::time_point start;
+
+    std::thread                 thread;
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::atomic<bool>           running;
+};
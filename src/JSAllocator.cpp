@@ -0,0 +1,144 @@
+#include "JSAllocator.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static const size_t CLASS_SIZES[JS_ALLOCATOR_CLASSES] = { 16, 32, 64, 128, 256, 512, 1024 };
+
+// Every block is preceded by a header that keeps the max alignment malloc gives
+static const size_t HEADER_SIZE = 16;
+static const uint32_t LARGE = 0xFFFFFFFF;
+
+struct BlockHeader {
+    uint32_t    sizeClass;  // index on CLASS_SIZES, or LARGE
+    uint32_t    pad;
+    uint64_t    size;       // requested size
+};
+
+static inline BlockHeader* headerOf(void* _ptr) {
+    return (BlockHeader*)((char*)_ptr - HEADER_SIZE);
+}
+
+JSAllocator::JSAllocator() :
+    allocs(0),
+    frees(0),
+    reallocs(0),
+    pooled(0),
+    large(0),
+    inUse(0),
+    peak(0),
+    reserved(0) {
+    for (size_t i = 0; i < JS_ALLOCATOR_CLASSES; i++)
+        freeLists[i] = nullptr;
+}
+
+JSAllocator::~JSAllocator() {
+    for (size_t i = 0; i < slabs.size(); i++)
+        ::free(slabs[i]);
+}
+
+int JSAllocator::sizeClass(size_t _size) const {
+    for (int i = 0; i < JS_ALLOCATOR_CLASSES; i++)
+        if (_size <= CLASS_SIZES[i])
+            return i;
+    return -1;
+}
+
+bool JSAllocator::grow(int _class) {
+    char* slab = (char*)::malloc(JS_ALLOCATOR_SLAB);
+    if (slab == nullptr)
+        return false;
+
+    slabs.push_back(slab);
+    reserved += JS_ALLOCATOR_SLAB;
+
+    size_t slot = HEADER_SIZE + CLASS_SIZES[_class];
+    for (size_t offset = 0; offset + slot <= JS_ALLOCATOR_SLAB; offset += slot) {
+        FreeSlot* s = (FreeSlot*)(slab + offset);
+        s->next = freeLists[_class];
+        freeLists[_class] = s;
+    }
+    return true;
+}
+
+void* JSAllocator::alloc(size_t _size) {
+    if (_size == 0)
+        return nullptr;
+
+    BlockHeader* header = nullptr;
+    int c = sizeClass(_size);
+
+    if (c >= 0) {
+        if (freeLists[c] == nullptr && !grow(c))
+            return nullptr;
+
+        FreeSlot* s = freeLists[c];
+        freeLists[c] = s->next;
+        header = (BlockHeader*)s;
+        header->sizeClass = (uint32_t)c;
+        pooled++;
+    }
+    else {
+        header = (BlockHeader*)::malloc(HEADER_SIZE + _size);
+        if (header == nullptr)
+            return nullptr;
+        header->sizeClass = LARGE;
+        large++;
+    }
+
+    header->size = _size;
+    allocs++;
+    inUse += _size;
+    if (inUse > peak)
+        peak = inUse;
+
+    return (char*)header + HEADER_SIZE;
+}
+
+void JSAllocator::free(void* _ptr) {
+    if (_ptr == nullptr)
+        return;
+
+    BlockHeader* header = headerOf(_ptr);
+    frees++;
+    inUse -= header->size;
+
+    if (header->sizeClass == LARGE)
+        ::free(header);
+    else {
+        FreeSlot* s = (FreeSlot*)header;
+        uint32_t c = header->sizeClass;
+        s->next = freeLists[c];
+        freeLists[c] = s;
+    }
+}
+
+void* JSAllocator::realloc(void* _ptr, size_t _size) {
+    if (_ptr == nullptr)
+        return alloc(_size);
+
+    if (_size == 0) {
+        free(_ptr);
+        return nullptr;
+    }
+
+    reallocs++;
+    BlockHeader* header = headerOf(_ptr);
+
+    // still fits on the same slot
+    if (header->sizeClass != LARGE && _size <= CLASS_SIZES[header->sizeClass]) {
+        inUse = inUse - header->size + _size;
+        if (inUse > peak)
+            peak = inUse;
+        header->size = _size;
+        return _ptr;
+    }
+
+    void* ptr = alloc(_size);
+    if (ptr == nullptr)
+        return nullptr;
+
+    memcpy(ptr, _ptr, header->size < _size ? header->size : _size);
+    free(_ptr);
+    return ptr;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Size classes of the pools (bigger allocations go to malloc)
+#define JS_ALLOCATOR_CLASSES 7
+#define JS_ALLOCATOR_SLAB (64 * 1024)
+
+// Allocator for the Duktape heap. Small blocks come from per size class
+// free lists carved out of 64KB slabs, so the objects, arrays and strings
+// built on every event don't go through malloc. Not thread safe, like the
+// heap itself.
+//
+class JSAllocator {
+public:
+
+    JSAllocator();
+    virtual ~JSAllocator();
+
+    void*   alloc(size_t _size);
+    void*   realloc(void* _ptr, size_t _size);
+    void    free(void* _ptr);
+
+    size_t  allocs;
+    size_t  frees;
+    size_t  reallocs;
+    size_t  pooled;         // allocations served by a pool
+    size_t  large;          // allocations sent to malloc
+    size_t  inUse;          // bytes requested and not freed
+    size_t  peak;
+    size_t  reserved;       // bytes on slabs
+
+protected:
+    struct FreeSlot {
+        FreeSlot*   next;
+    };
+
+    int     sizeClass(size_t _size) const;
+    bool    grow(int _class);
+
+    FreeSlot*           freeLists[JS_ALLOCATOR_CLASSES];
+    std::vector<void*>  slabs;
+};
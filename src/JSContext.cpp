@@ -5,12 +5,37 @@
 #include "Context.h"
 #include "JSContext.h"
 
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cerrno>
+#include <sys/stat.h>
+
 const static char INSTANCE_ID[] = "\xff""\xff""obj";
 const static char FUNC_ID[] = "\xff""\xff""fns";
+const static char DATA_ID[] = "\xff""\xff""dat";
+
+duk_bool_t jsExecTimeoutCheck(void* udata) {
+    return udata != nullptr && ((JSContext*)udata)->checkTimeout();
+}
+
+void* JSContext::jsAlloc(void* userData, duk_size_t size) {
+    return ((JSContext*)userData)->allocator.alloc(size);
+}
+
+void* JSContext::jsRealloc(void* userData, void* ptr, duk_size_t size) {
+    return ((JSContext*)userData)->allocator.realloc(ptr, size);
+}
+
+void JSContext::jsFree(void* userData, void* ptr) {
+    ((JSContext*)userData)->allocator.free(ptr);
+}
 
 JSContext::JSContext() {
-    // Create duktape heap with default allocation functions and custom fatal error handler.
-    _ctx = duk_create_heap(nullptr, nullptr, nullptr, nullptr, fatalErrorHandler);
+    // Create duktape heap with pooled allocation functions and custom fatal error handler.
+    // The heap's user data is this context, for the allocator and the exec timeout check
+    _ctx = duk_create_heap(jsAlloc, jsRealloc, jsFree, this, fatalErrorHandler);
 
     //// Create global geometry constants
     // TODO make immutable
@@ -70,12 +95,25 @@ JSContext::JSContext() {
     if (!duk_put_global_string(_ctx, FUNC_ID)) {
         printf("'fns' object not set");
     }
+
+    // Set up 'dat' array.
+    duk_push_array(_ctx);
+    if (!duk_put_global_string(_ctx, DATA_ID)) {
+        printf("'dat' object not set");
+    }
 }
 
 JSContext::~JSContext() {
     duk_destroy_heap(_ctx);
 }
 
+void JSContext::gc() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    duk_gc(_ctx, 0);
+    gcTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    gcCount++;
+}
+
 void JSContext::setGlobalValue(const std::string& name, JSValue value) {
     value.ensureExistsOnStackTop();
     duk_put_global_lstring(_ctx, name.data(), name.length());
@@ -89,17 +127,19 @@ bool JSContext::setFunction(JSFunctionIndex index, const std::string& source) {
         return false;
     }
 
-    duk_push_string(_ctx, source.c_str());
-    duk_push_string(_ctx, "");
-
-    if (duk_pcompile(_ctx, DUK_COMPILE_FUNCTION) == 0) {
+    if (compileFunction(source)) {
         duk_put_prop_index(_ctx, -2, index);
+
+        if (stats.size() <= index)
+            stats.resize(index + 1);
+        stats[index] = JSFunctionStats();
+        stats[index].name = std::to_string(index);
     } 
     else {
         printf("Compile failed: %s\n%s\n---",
              duk_safe_to_string(_ctx, -1),
              source.c_str());
-        duk_pop(_ctx);
+        duk_pop_2(_ctx);
         return false;
     }
 
@@ -109,6 +149,180 @@ bool JSContext::setFunction(JSFunctionIndex index, const std::string& source) {
     return true;
 }
 
+bool JSContext::getGlobalNumber(const std::string& object, const std::string& prop, float* value) {
+    bool rta = false;
+    if (duk_get_global_lstring(_ctx, object.data(), object.length()) && duk_is_object(_ctx, -1)) {
+        if (duk_get_prop_lstring(_ctx, -1, prop.data(), prop.length()) && duk_is_number(_ctx, -1)) {
+            *value = (float)duk_get_number(_ctx, -1);
+            rta = true;
+        }
+        duk_pop(_ctx);
+    }
+    duk_pop(_ctx);
+    return rta;
+}
+
+bool JSContext::setGlobalNumber(const std::string& object, const std::string& prop, float value) {
+    bool rta = false;
+    if (duk_get_global_lstring(_ctx, object.data(), object.length()) && duk_is_object(_ctx, -1)) {
+        duk_push_number(_ctx, value);
+        duk_put_prop_lstring(_ctx, -2, prop.data(), prop.length());
+        rta = true;
+    }
+    duk_pop(_ctx);
+    return rta;
+}
+
+bool JSContext::setCacheFolder(const std::string& folder) {
+    cacheFolder = folder;
+    if (cacheFolder.empty())
+        return true;
+
+    if (cacheFolder.back() != '/')
+        cacheFolder += '/';
+
+    // Create it (and its parent) if it doesn't exist
+    size_t pos = 1;
+    while ((pos = cacheFolder.find('/', pos)) != std::string::npos) {
+        std::string dir = cacheFolder.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            std::cout << "Can't create the JS cache folder " << dir << ": " << strerror(errno) << std::endl;
+            cacheFolder.clear();
+            return false;
+        }
+        pos++;
+    }
+
+    return true;
+}
+
+static uint64_t fnv1a(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash of the engine version and the source
+static std::string sourceHash(const std::string& source) {
+    std::string key = std::to_string((long)DUK_VERSION) + ":" + source;
+
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << fnv1a(key.data(), key.size());
+    return out.str();
+}
+
+static duk_ret_t loadFunction(duk_context* ctx, void*) {
+    duk_load_function(ctx);
+    return 1;
+}
+
+// Cache files are the hash of the bytecode followed by the bytecode.
+// Duktape doesn't validate bytecode, so a damaged file must never reach it.
+bool JSContext::loadCachedFunction(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return false;
+
+    std::streamsize size = file.tellg();
+    if (size <= 8)
+        return false;
+    size -= 8;
+    file.seekg(0, std::ios::beg);
+
+    uint64_t hash = 0;
+    if (!file.read((char*)&hash, 8))
+        return false;
+
+    void* buffer = duk_push_fixed_buffer(_ctx, (duk_size_t)size);
+    if (!file.read((char*)buffer, size) || fnv1a((const char*)buffer, size) != hash) {
+        duk_pop(_ctx);
+        return false;
+    }
+
+    if (duk_safe_call(_ctx, loadFunction, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+        duk_pop(_ctx);
+        return false;
+    }
+
+    return true;
+}
+
+bool JSContext::compileFunction(const std::string& source) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::string path;
+    if (!cacheFolder.empty()) {
+        path = cacheFolder + sourceHash(source) + ".duk";
+
+        if (loadCachedFunction(path)) {
+            cacheHits++;
+            compileTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return true;
+        }
+    }
+
+    if (duk_pcompile_lstring(_ctx, DUK_COMPILE_FUNCTION, source.data(), source.length()) != 0) {
+        compileTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return false;
+    }
+
+    if (!path.empty()) {
+        cacheMisses++;
+
+        // [ fn ] -> [ fn buffer ]
+        duk_dup_top(_ctx);
+        duk_dump_function(_ctx);
+
+        duk_size_t size = 0;
+        void* data = duk_get_buffer(_ctx, -1, &size);
+        uint64_t hash = fnv1a((const char*)data, size);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (file.is_open()) {
+            file.write((const char*)&hash, 8);
+            file.write((const char*)data, size);
+        }
+
+        duk_pop(_ctx);
+    }
+
+    compileTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+bool JSContext::setData(uint32_t index, JSValue value) {
+    // Get all data objects (array) in context
+    if (!duk_get_global_string(_ctx, DATA_ID)) {
+        std::cout << "SetData - data array not initialized" << std::endl;
+        duk_pop(_ctx); // pop [undefined] sitting at stack top
+        return false;
+    }
+
+    duk_idx_t array = duk_normalize_index(_ctx, -1);
+    value.ensureExistsOnStackTop();
+    duk_put_prop_index(_ctx, array, index);
+
+    // Pop the data array off the stack
+    duk_pop(_ctx);
+
+    return true;
+}
+
+JSValue JSContext::getData(uint32_t index) {
+    if (!duk_get_global_string(_ctx, DATA_ID)) {
+        duk_pop(_ctx); // pop [undefined] sitting at stack top
+        return newNull();
+    }
+
+    duk_get_prop_index(_ctx, -1, index);
+
+    // remove the data array, leaving the object on the stack top
+    duk_remove(_ctx, -2);
+    return getStackTopValue();
+}
+
 // bool JSContext::evaluateBooleanFunction(uint32_t index) {
 //     if (!evaluateFunction(index)) {
 //         return false;
@@ -130,6 +344,94 @@ JSValue JSContext::getFunctionResult(uint32_t index) {
     return getStackTopValue();
 }
 
+size_t JSContext::getFunctionLength(JSFunctionIndex index) {
+    if (!pushFunction(index))
+        return 0;
+
+    duk_get_prop_string(_ctx, -1, "length");
+    size_t length = (size_t)duk_to_uint(_ctx, -1);
+    duk_pop_2(_ctx);
+    return length;
+}
+
+bool JSContext::pushFunction(JSFunctionIndex index) {
+    if (!duk_get_global_string(_ctx, FUNC_ID)) {
+        duk_pop(_ctx); // pop [undefined] sitting at stack top
+        return false;
+    }
+
+    if (!duk_get_prop_index(_ctx, -1, index)) {
+        duk_pop_2(_ctx); // pop "undefined" and the functions array
+        return false;
+    }
+
+    // remove the functions array, leaving the function on the stack top
+    duk_remove(_ctx, -2);
+    calling = index;
+    return true;
+}
+
+JSValue JSContext::callFunction(size_t nargs) {
+    if (!call(nargs))
+        return JSValue();
+    return getStackTopValue();
+}
+
+void JSContext::resetFunctionStats(JSFunctionIndex index) {
+    if (index >= stats.size())
+        return;
+
+    std::string name = stats[index].name;
+    stats[index] = JSFunctionStats();
+    stats[index].name = name;
+}
+
+void JSContext::setTimeBudget(double ms, size_t strikes) {
+    budget = ms;
+    maxStrikes = strikes;
+}
+
+// Calls the function pushed by pushFunction() with a deadline, and times it
+bool JSContext::call(size_t nargs) {
+    auto start = std::chrono::steady_clock::now();
+    if (budget > 0.0)
+        deadline = start + std::chrono::microseconds((int64_t)(budget * 1000.0));
+
+    inCall = true;
+    interrupted = false;
+    bool ok = duk_pcall(_ctx, nargs) == 0;
+    inCall = false;
+
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    JSFunctionStats* stat = calling < stats.size() ? &stats[calling] : nullptr;
+    if (stat) {
+        stat->calls++;
+        stat->totalTime += elapsed;
+        if (elapsed > stat->maxTime)
+            stat->maxTime = elapsed;
+    }
+
+    if (!ok) {
+        if (interrupted && stat) {
+            stat->timeouts++;
+            std::cout << "Function " << stat->name << " was interrupted after " << elapsed << "ms (budget " << budget << "ms)" << std::endl;
+
+            if (stat->timeouts >= maxStrikes && !stat->disabled) {
+                stat->disabled = true;
+                std::cout << "Function " << stat->name << " disabled after " << stat->timeouts << " timeouts" << std::endl;
+            }
+        }
+        else
+            printf("EvalFilterFn: %s", duk_safe_to_string(_ctx, -1));
+
+        duk_pop(_ctx);
+        return false;
+    }
+
+    return true;
+}
+
 JSValue JSContext::newNull() {
     duk_push_null(_ctx);
     return getStackTopValue();
@@ -161,7 +463,7 @@ JSValue JSContext::newObject() {
 }
 
 JSValue JSContext::newFunction(const std::string& value) {
-    if (duk_pcompile_lstring(_ctx, DUK_COMPILE_FUNCTION, value.data(), value.length()) != 0) {
+    if (!compileFunction(value)) {
         auto error = duk_safe_to_string(_ctx, -1);
         printf("Compile failed in global function: %s\n%s\n---", error, value.c_str());
         duk_pop(_ctx); // Pop error.
@@ -170,7 +472,14 @@ JSValue JSContext::newFunction(const std::string& value) {
     return getStackTopValue();
 }
 
-bool JSContext::addNativeFunction(const std::string& _name, duk_c_function func, size_t nargs) {
+void* JSContext::getUserData(duk_context* ctx) {
+    // the heap's user data is the JSContext
+    duk_memory_functions funcs;
+    duk_get_memory_functions(ctx, &funcs);
+    return funcs.udata ? ((JSContext*)funcs.udata)->userData : nullptr;
+}
+
+bool JSContext::addNativeFunction(const std::string& _name, duk_c_function func, duk_idx_t nargs) {
     duk_push_c_function(_ctx, func, nargs);
     duk_put_global_string(_ctx, _name.c_str());
     return true;
@@ -236,30 +545,12 @@ void JSContext::fatalErrorHandler(void*, const char* message) {
 }
 
 bool JSContext::evaluateFunction(uint32_t index) {
-    // Get all functions (array) in context
-    if (!duk_get_global_string(_ctx, FUNC_ID)) {
-        printf("EvalFilterFn - functions array not initialized");
-        duk_pop(_ctx); // pop [undefined] sitting at stack top
-        return false;
-    }
-
     // Get function at index `id` from functions array, put it at stack top
-    if (!duk_get_prop_index(_ctx, -1, index)) {
+    if (!pushFunction(index)) {
         printf("EvalFilterFn - function %d not set", index);
-        duk_pop(_ctx); // pop "undefined" sitting at stack top
-        duk_pop(_ctx); // pop functions (array) now sitting at stack top
-        return false;
-    }
-
-    // pop fns array
-    duk_remove(_ctx, -2);
-
-    // call popped function (sitting at stack top), evaluated value is put on stack top
-    if (duk_pcall(_ctx, 0) != 0) {
-        printf("EvalFilterFn: %s", duk_safe_to_string(_ctx, -1));
-        duk_pop(_ctx);
         return false;
     }
 
-    return true;
+    // call it, evaluated value is put on stack top
+    return call(0);
 }
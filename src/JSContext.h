@@ -1,11 +1,24 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <chrono>
 #include "JSValue.h"
+#include "JSAllocator.h"
 
 using JSScopeMarker = int32_t;
 using JSFunctionIndex = uint32_t;
 
+// Execution time of each function
+struct JSFunctionStats {
+    std::string name;           // for the diagnostics
+    size_t  calls = 0;
+    size_t  timeouts = 0;
+    double  totalTime = 0.0;    // milliseconds
+    double  maxTime = 0.0;
+    bool    disabled = false;
+};
+
 class JSContext {
 public:
 
@@ -23,19 +36,93 @@ public:
     bool    setFunction(JSFunctionIndex index, const std::string& source);
     JSValue getFunctionResult(JSFunctionIndex index);
 
-    bool    addNativeFunction(const std::string& _name, duk_c_function func, size_t nargs);
+    // Number of arguments the function declares
+    size_t  getFunctionLength(JSFunctionIndex index);
+
+    // Push the function, then push its 'nargs' arguments and call it
+    bool    pushFunction(JSFunctionIndex index);
+    JSValue callFunction(size_t nargs);
+
+    // 'nargs' can be DUK_VARARGS
+    bool    addNativeFunction(const std::string& _name, duk_c_function func, duk_idx_t nargs);
+
+    // For native functions to find their way back (ex: to the Context)
+    void*   userData = nullptr;
+    static void* getUserData(duk_context* ctx);
+
+    // Objects kept alive between calls (ex: the 'data' of each binding)
+    bool    setData(uint32_t index, JSValue value);
+    JSValue getData(uint32_t index);
 
     void    setGlobalValue(const std::string& name, JSValue value);
 
+    // Number on a property of a global object (ex: global.track)
+    bool    getGlobalNumber(const std::string& object, const std::string& prop, float* value);
+    bool    setGlobalNumber(const std::string& object, const std::string& prop, float value);
+
+    // Compiled functions are dumped to (and loaded from) this folder, named
+    // by a hash of their source. Empty disables it.
+    bool    setCacheFolder(const std::string& folder);
+    const std::string& getCacheFolder() const { return cacheFolder; }
+
+    // Calls taking longer than 'ms' are interrupted, after 'strikes' of them
+    // the function is disabled. 0 ms turns it off.
+    void    setTimeBudget(double ms, size_t strikes);
+    void    setFunctionName(JSFunctionIndex index, const std::string& name) { if (index < stats.size()) stats[index].name = name; }
+    bool    isFunctionDisabled(JSFunctionIndex index) const { return index < stats.size() && stats[index].disabled; }
+    // Clears the counters and the timeouts, enabling it again (ex: kept on a reload)
+    void    resetFunctionStats(JSFunctionIndex index);
+    const std::vector<JSFunctionStats>& getFunctionStats() const { return stats; }
+
+    // checked by Duktape every few thousand instructions, remembers
+    // when it interrupts the call
+    bool    checkTimeout() {
+        if (inCall && budget > 0.0 && std::chrono::steady_clock::now() > deadline)
+            interrupted = true;
+        return interrupted;
+    }
+
+    size_t  cacheHits = 0;
+    size_t  cacheMisses = 0;
+    double  compileTime = 0.0;  // milliseconds spent on setFunction/newFunction
+
+    // Runs a full mark-and-sweep (ex: while nothing is happening, so the
+    // voluntary one doesn't fire in the middle of a burst)
+    void    gc();
+    size_t  getAllocCount() const { return allocator.allocs; }
+    const JSAllocator& getAllocator() const { return allocator; }
+
+    size_t  gcCount = 0;
+    double  gcTime = 0.0;       // milliseconds
+
     JSScopeMarker getScopeMarker();
     void    resetToScopeMarker(JSScopeMarker marker);
 
 private:
     static void fatalErrorHandler(void* userData, const char* message);
+    static void* jsAlloc(void* userData, duk_size_t size);
+    static void* jsRealloc(void* userData, void* ptr, duk_size_t size);
+    static void  jsFree(void* userData, void* ptr);
 
     bool    evaluateFunction(uint32_t index);
+    bool    call(size_t nargs);
+
+    // Leaves the compiled function on the stack top
+    bool    compileFunction(const std::string& source);
+    bool    loadCachedFunction(const std::string& path);
 
     JSValue getStackTopValue() { return JSValue(_ctx, duk_normalize_index(_ctx, -1)); }
 
+    // declared before the heap, so it outlives it
+    JSAllocator allocator;
     duk_context* _ctx = nullptr;
+    std::string cacheFolder;
+
+    std::vector<JSFunctionStats>            stats;
+    JSFunctionIndex                         calling = 0;
+    bool                                    inCall = false;
+    bool                                    interrupted = false;
+    double                                  budget = 0.0;
+    size_t                                  maxStrikes = 3;
+    std::chrono::steady_clock::time_point   deadline;
 };
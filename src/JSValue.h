@@ -48,6 +48,23 @@ public:
         return JSValue(_ctx, duk_normalize_index(_ctx, -1));
     }
 
+    // Own properties, one at a time: call getNextProperty() on the enumerator
+    // until it returns an empty value. Each call pushes the key and the value.
+    JSValue getEnumerator() {
+        duk_enum(_ctx, _index, DUK_ENUM_OWN_PROPERTIES_ONLY);
+        return JSValue(_ctx, duk_normalize_index(_ctx, -1));
+    }
+
+    JSValue getNextProperty(std::string& key) {
+        if (!duk_next(_ctx, _index, 1))
+            return JSValue();
+
+        duk_size_t length = 0;
+        const char* str = duk_get_lstring(_ctx, -2, &length);
+        key.assign(str ? str : "", str ? length : 0);
+        return JSValue(_ctx, duk_normalize_index(_ctx, -1));
+    }
+
     void    setValueAtIndex(size_t index, JSValue value) {
         value.ensureExistsOnStackTop();
         duk_put_prop_index(_ctx, _index, static_cast<duk_uarridx_t>(index));
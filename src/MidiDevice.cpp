@@ -7,6 +7,8 @@
 #include "types/Vector.h"
 
 #include "Context.h"
+#include "Recorder.h"
+#include "VirtualClock.h"
 
 #include <thread>
 #include <chrono>
@@ -53,15 +55,25 @@ std::string statusNames[18] = {
     "END_OF_SYSEX"
 };
 
-unsigned char MidiDevice::getStatusByte(size_t i) { return statusByte[i]; }
-std::string MidiDevice::getStatusName(size_t i) { return statusNames[i]; }
+const std::string statusNone = "NONE";
 
-std::string MidiDevice::statusByteToName(const unsigned char& _type) {
-    for (int i = 0; i < 18; i++ ) {
-        if (statusByte[i] == _type)
-            return statusNames[i];
+// Interned names indexed by status byte, so looking one up doesn't scan or copy
+struct StatusNameTable {
+    StatusNameTable() {
+        for (size_t i = 0; i < 256; i++)
+            names[i] = &statusNone;
+        for (size_t i = 0; i < 18; i++)
+            names[ statusByte[i] ] = &statusNames[i];
     }
-    return "NONE";
+    const std::string* names[256];
+};
+const StatusNameTable statusNameTable;
+
+unsigned char MidiDevice::getStatusByte(size_t i) { return statusByte[i]; }
+const std::string& MidiDevice::getStatusName(size_t i) { return statusNames[i]; }
+
+const std::string& MidiDevice::statusByteToName(const unsigned char& _type) {
+    return *statusNameTable.names[_type];
 }
 
 unsigned char MidiDevice::statusNameToByte(const std::string& _name) {
@@ -74,6 +86,8 @@ unsigned char MidiDevice::statusNameToByte(const std::string& _name) {
 
 // VIRTUAL PORT
 MidiDevice::MidiDevice(void* _ctx, const std::string& _name) : 
+    midiPort(0),
+    id(0),
     defaultOutChannel(0),
     defaultOutStatus(MidiDevice::CONTROLLER_CHANGE),
     tickCounter(0),
@@ -87,15 +101,21 @@ MidiDevice::MidiDevice(void* _ctx, const std::string& _name) :
 
 // REAL PORT
 MidiDevice::MidiDevice(void* _ctx, const std::string& _name, size_t _midiPort) : 
+    midiPort(_midiPort),
+    id(0),
     defaultOutChannel(0),
     defaultOutStatus(MidiDevice::CONTROLLER_CHANGE),
+    tickCounter(0),
     midiIn(NULL), 
     midiOut(NULL)
 {
     type = DEVICE_MIDI;
     ctx = _ctx;
     name = _name;
-    midiPort = _midiPort;
+
+    // The queue needs to exist before the first callback
+    Context *context = static_cast<Context*>(ctx);
+    queue.allocate(context->queueSize, context->queuePolicy);
 
     openInPort(_name, _midiPort);
     openOutPort(_name, _midiPort);
@@ -158,7 +178,7 @@ void MidiDevice::trigger(const unsigned char _status, unsigned char _channel) {
     msg.push_back( _status );
     if (_channel > 0 && _channel < 16 )
         msg[0] += _channel-1;
-    midiOut->sendMessage( &msg );   
+    send( &msg[0], msg.size() );
 }
 
 void MidiDevice::trigger(const unsigned char _status, unsigned char _channel, size_t _key, size_t _value) {
@@ -175,78 +195,66 @@ void MidiDevice::trigger(const unsigned char _status, unsigned char _channel, si
     if (_channel > 0 && _channel < 16 )
         msg[0] += _channel-1;
 
-    midiOut->sendMessage( &msg );   
+    send( &msg[0], msg.size() );
 }
 
-void extractHeader(std::vector<unsigned char>* _message, unsigned char& _channel, unsigned char& _status, int& _bytes) {
-    int j = 0;
-
-    if ((_message->at(0) & 0xf0) != 0xf0) {
-        _channel = _message->at(0) & 0x0f;
-        _channel += 1;
-        _status = _message->at(0) & 0xf0;
-    }
-    else {
-        _channel = 0;
-        _status = _message->at(0);
+void MidiDevice::send(const unsigned char* _msg, size_t _size) {
+    if (Recorder::isOpen()) {
+        std::lock_guard<std::mutex> lock(outMutex);
+        Recorder::midi(name, _msg, _size);
+        return;
     }
 
+    if (midiOut == NULL)
+        return;
+
+    std::lock_guard<std::mutex> lock(outMutex);
+    midiOut->sendMessage( _msg, _size );
+}
+
+int MidiDevice::statusDataBytes(const unsigned char& _status) {
     switch (_status) {
         case MidiDevice::CONTROLLER_CHANGE:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::NOTE_ON:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::NOTE_OFF:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::KEY_PRESSURE:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::PROGRAM_CHANGE:
-            _bytes = 1;
-            break;
+            return 1;
 
         case MidiDevice::CHANNEL_PRESSURE:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::PITCH_BEND:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::SONG_POSITION:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::SONG_SELECT:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::TUNE_REQUEST:
-            _bytes = 2;
-            break;
+            return 2;
 
         case MidiDevice::TIMING_TICK:
-            _bytes = 0;
-            break;
+            return 0;
 
         case MidiDevice::START_SONG:
-            _bytes = 0;
-            break;
+            return 0;
 
         case MidiDevice::CONTINUE_SONG:
-            _bytes = 0;
-            break;
+            return 0;
 
         case MidiDevice::STOP_SONG:
-            _bytes = 0;
-            break;
+            return 0;
 
         case MidiDevice::SYSTEM_EXCLUSIVE:
             // if(_message->size() == 6) {
@@ -264,16 +272,28 @@ void extractHeader(std::vector<unsigned char>* _message, unsigned char& _channel
             //     else if(type == 9)
             //         _type = "mmc_pause";
             // }
-            _bytes = 0;
-            break;
+            return 0;
 
         default:
-            _bytes = 0;
-            break;
+            return 0;
     }
+}
+
+void extractHeader(const std::vector<unsigned char>& _message, unsigned char& _channel, unsigned char& _status, int& _bytes) {
+    if ((_message[0] & 0xf0) != 0xf0) {
+        _channel = _message[0] & 0x0f;
+        _channel += 1;
+        _status = _message[0] & 0xf0;
+    }
+    else {
+        _channel = 0;
+        _status = _message[0];
+    }
+
+    _bytes = MidiDevice::statusDataBytes(_status);
 
     if (_status == MidiDevice::NOTE_ON && 
-        _message->at(2) == 0) {
+        _message.size() > 2 && _message[2] == 0) {
         _status = MidiDevice::NOTE_OFF;
     }
 }
@@ -322,51 +342,91 @@ void MidiDevice::onMidi(double _deltatime, std::vector<unsigned char>* _message,
         exit(EXIT_FAILURE);
     }
 
+    if (nBytes == 0)
+        return;
+
     MidiDevice *device = static_cast<MidiDevice*>(_userData);
     Context *context = static_cast<Context*>(device->ctx);
 
+    // Only decode the header here, the rest happens on the dispatch thread
+    MidiEvent event;
+    decode(*_message, event);
+    event.timestamp = VirtualClock::micros();
+    event.device = device->id.load(std::memory_order_relaxed);
+
+    // The clock is followed here, with the arrival times, instead of
+    // after the queue (which can coalesce or drop them)
+    if (event.status >= MidiDevice::TIMING_TICK || event.status == MidiDevice::SONG_POSITION)
+        device->clock.process(event.status, event.key, event.value, event.timestamp);
+
+    // what nobody listens to doesn't need to wake up the dispatch thread
+    // (unless the bindings are being replaced, they could be new ones)
+    if (!context->reloading && !device->isBound(event))
+        return;
+
+    device->queue.push(event);
+    context->notifyDispatch();
+}
+
+void MidiDevice::decode(const std::vector<unsigned char>& _message, MidiEvent& _event) {
+    if (_message.empty())
+        return;
+
     int bytes = 0;
-    unsigned char status = 0;
-    unsigned char channel = 0;
-    extractHeader(_message, channel, status, bytes);
+    extractHeader(_message, _event.channel, _event.status, bytes);
 
     if (bytes < 2) {
-        if (context->doStatusExist(device->name, status)) {
-            YAML::Node node = context->getStatusNode(device->name, status);
+        if (_event.status == MidiDevice::PROGRAM_CHANGE && _message.size() > 1)
+            _event.value = _message[1];
+    }
+    else if (_message.size() > 2) {
+        _event.key = _message[1];
+        _event.value = _message[2];
+    }
+}
+
+// Without locks, from the MIDI callbacks, while the config can be reloading
+bool MidiDevice::isBound(const MidiEvent& _event) const {
+    Epoch::Guard guard;
+    if (statusDataBytes(_event.status) < 2)
+        return isStatusFnc(_event.status);
+    return isKeyFnc(_event.channel, _event.key);
+}
 
+// On the dispatch thread, with the bindings of the snapshot it's on
+void MidiDevice::process(const Table& _table, const MidiEvent& _event) {
+    Context *context = static_cast<Context*>(ctx);
+
+    unsigned char status = _event.status;
+    size_t channel = _event.channel;
+
+    if (statusDataBytes(status) < 2) {
+        const Binding* binding = context->getStatusBinding(_table, status);
+        if (binding) {
             size_t target_value = 0;
             if (status == MidiDevice::TIMING_TICK) {
-                target_value = device->tickCounter;
-                device->tickCounter++;
-                if (device->tickCounter > 127)
-                    device->tickCounter = 0;
+                target_value = tickCounter;
+                tickCounter++;
+                if (tickCounter > 127)
+                    tickCounter = 0;
             }
             else if (status == MidiDevice::PROGRAM_CHANGE)
-                target_value = _message->at(1);
+                target_value = _event.value;
 
-            context->configMutex.lock();
-            context->processEvent(node, device->name, status, 0, 0, target_value, true);
-            context->configMutex.unlock();
+            context->processEvent(*binding, this, status, 0, 0, target_value);
         }
     }
     else {
-        size_t key = _message->at(1);
-        size_t target_value = _message->at(2);
-
-        if (context->doKeyExist(device->name, (size_t)channel, key)) {
-            YAML::Node node = context->getKeyNode(device->name, (size_t)channel, key);
+        size_t key = _event.key;
+        size_t target_value = _event.value;
 
-            if (node["status"].IsDefined()) {
-                unsigned char target_status = statusNameToByte(node["status"].as<std::string>());
-                if (target_status != status)
-                    return;
-            }
+        const Binding* binding = context->getKeyBinding(_table, channel, key);
+        if (binding) {
+            if (binding->status != 0 && binding->status != status)
+                return;
             
-            context->configMutex.lock();
-            context->processEvent(node, device->name, status, (size_t)channel, key, (float)target_value, false);
-            context->configMutex.unlock();
+            context->processEvent(*binding, this, status, channel, key, (float)target_value);
         }
     }
 }
 
-
@@ -7,10 +7,14 @@
 #include <cstring>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <atomic>
 
 #include "rtmidi/RtMidi.h"
 
 #include "Device.h"
+#include "EventQueue.h"
+#include "ClockFollower.h"
 
 class MidiDevice : public Device {
 public:
@@ -47,24 +51,38 @@ public:
     static std::vector<std::string> getOutPorts();
 
     static void onMidi(double, std::vector<unsigned char>*, void*);
+    static void decode(const std::vector<unsigned char>& _message, MidiEvent& _event);
+    bool        isBound(const MidiEvent& _event) const;
+    void        process(const Table& _table, const MidiEvent& _event);
 
-    static std::string getStatusName(size_t i);
+    static const std::string& getStatusName(size_t i);
     static unsigned char getStatusByte(size_t i);
-    static std::string statusByteToName(const unsigned char& _byte);
+    static const std::string& statusByteToName(const unsigned char& _byte);
     static unsigned char statusNameToByte(const std::string& _name);
+    static int  statusDataBytes(const unsigned char& _status);
     static void parseDeviceType(const std::string& _address, std::string& _deviceName, unsigned char& _statusType);
 
     void        trigger(unsigned char _status, unsigned char _channel);
     void        trigger(unsigned char _status, unsigned char _channel, size_t _key, size_t _value);
 
+    // Raw message, safe to call from other threads (ex: the clock)
+    void        send(const unsigned char* _msg, size_t _size);
+
     size_t      midiPort;
-    
+    // index on the context's inputDevices; read by the RtMidi callback and
+    // set again when a reload keeps the device
+    std::atomic<uint32_t> id;
+
     size_t          defaultOutChannel;
     unsigned char   defaultOutStatus;
     size_t          tickCounter;
 
+    // Tempo and position of the incoming MIDI clock, if any
+    ClockFollower   clock;
+
 protected:
     RtMidiIn*   midiIn;
     RtMidiOut*  midiOut;
+    std::mutex  outMutex;
 };
 
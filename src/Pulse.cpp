@@ -1,48 +1,151 @@
 #include "Pulse.h"
 
+#include <cmath>
 #include <chrono>
 #include <string>
 
 #include "Context.h"
+#include "VirtualClock.h"
 
-Pulse::Pulse(void* _ctx, size_t _index) {
+Pulse::Pulse(void* _ctx, const std::string& _name) {
     type = DEVICE_PULSE;
     ctx = _ctx;
     defaultOutChannel = 0;
-    name = ((Context*)ctx)->config["pulse"][_index]["name"].as<std::string>();
-    // setKeyFnc(0, _index, _index);
-    setStatusFnc(MidiDevice::TIMING_TICK, _index);
-    index = _index;
+    name = _name;
+
+    // ticks wait there for the dispatch thread, like MIDI messages
+    Context* context = (Context*)_ctx;
+    queue.allocate(context->queueSize, context->queuePolicy);
+
+    ticks = 0;
+    overruns = 0;
+    jitterTotal = 0.0;
+    jitterMax = 0.0;
+    period = std::chrono::steady_clock::duration::zero();
+    counter = 0.0;
+    running = false;
+
+    clock = nullptr;
+    division = 1.0;
+    target = -1.0;
+    epoch = 0;
+    armed = false;
 }   
 
 Pulse::~Pulse() {
+    stop();
 }
 
-void Pulse::start(size_t _milliSec) {
-    this->clear = false;
-
-    t = std::thread([=]() {
-        float counter = 0.0;
-        while (true && !this->clear) {
-            if (this->clear) break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(_milliSec));
-            if (this->clear) break;
-            
-            if (((Context*)ctx)->safe) {
-                ((Context*)ctx)->configMutex.lock();
-                ((Context*)ctx)->processEvent(((Context*)ctx)->config["pulse"][index], name, MidiDevice::TIMING_TICK, 0, 0, counter, true);
-                ((Context*)ctx)->configMutex.unlock();
-            }
-
-            counter++;
-            if (counter > 127.0)
-                counter = 0.0;
-        }
-    });
-    // t.detach();
+void Pulse::start(double _period) {
+    if (running || _period <= 0.0)
+        return;
+
+    period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(_period));
+    running = true;
+    ((Context*)ctx)->scheduler.add(this);
+}
+
+void Pulse::sync(ClockFollower* _clock, double _division) {
+    if (running || _clock == nullptr || _division <= 0.0)
+        return;
+
+    clock = _clock;
+    division = _division;
+    target = -1.0;
+    running = true;
+    ((Context*)ctx)->scheduler.add(this);
 }
 
 void Pulse::stop() {
-    clear = true;
-    t.join();
-}
\ No newline at end of file
+    if (!running)
+        return;
+
+    ((Context*)ctx)->scheduler.remove(this);
+    running = false;
+}
+
+bool Pulse::tick() {
+    float value = counter;
+
+    if (clock) {
+        if (!armed || clock->getEpoch() != epoch)
+            return false;
+
+        // number of the subdivision since START
+        value = std::fmod(std::floor(target * division / CLOCK_PPQN + 0.5), 128.0);
+    }
+
+    if (((Context*)ctx)->safe) {
+        MidiEvent event;
+        event.timestamp = VirtualClock::micros();
+        event.status = MidiDevice::TIMING_TICK;
+        event.value = (unsigned char)value;
+        queue.push(event);
+        ((Context*)ctx)->notifyDispatch();
+    }
+
+    if (clock)
+        target += CLOCK_PPQN / division;
+    else {
+        counter++;
+        if (counter > 127.0)
+            counter = 0.0;
+    }
+    return true;
+}
+
+// On the dispatch thread, with the bindings of the snapshot it's on
+void Pulse::process(const Table& _table, const MidiEvent& _event) {
+    Context* context = (Context*)ctx;
+    const Binding* binding = context->getStatusBinding(_table, MidiDevice::TIMING_TICK);
+    if (binding)
+        context->processEvent(*binding, this, MidiDevice::TIMING_TICK, 0, 0, _event.value);
+}
+
+// While following a clock the deadline is checked again every few
+// milliseconds, so a tempo change moves it
+#define PULSE_SYNC_CHECK std::chrono::milliseconds(10)
+
+void Pulse::advance(std::chrono::steady_clock::time_point _now) {
+    if (!clock) {
+        deadline += period;
+        if (deadline <= _now) {
+            size_t missed = (_now - deadline) / period + 1;
+            deadline += period * missed;
+            overruns.fetch_add(missed, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    armed = false;
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(_now.time_since_epoch()).count();
+    if (!clock->isRunning(now)) {
+        target = -1.0;
+        deadline = _now + PULSE_SYNC_CHECK;
+        return;
+    }
+
+    double step = CLOCK_PPQN / division;
+    double position = clock->getPosition(now);
+    size_t e = clock->getEpoch();
+
+    // (re)started: the first subdivision at or after the current position
+    if (target < 0.0 || e != epoch) {
+        epoch = e;
+        target = std::ceil(position / step - 1e-6) * step;
+    }
+    // more than a tick late: skip to the next one
+    else if (target + 1.0 < position) {
+        size_t missed = std::ceil((position - target) / step - 1e-6);
+        target += step * missed;
+        overruns.fetch_add(missed, std::memory_order_relaxed);
+    }
+
+    std::chrono::steady_clock::time_point time(std::chrono::microseconds(clock->getTime(target)));
+    if (time <= _now + PULSE_SYNC_CHECK) {
+        deadline = time;
+        armed = true;
+    }
+    else
+        deadline = _now + PULSE_SYNC_CHECK;
+}
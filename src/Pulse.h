@@ -1,25 +1,63 @@
 #pragma once
 
-#include <thread>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <string>
 
 #include "yaml-cpp/yaml.h"
 
 #include "Device.h"
+#include "ClockFollower.h"
 
 class Pulse : public Device {
 public:
 
-    Pulse(void* _ctx, size_t _index);
+    Pulse(void* _ctx, const std::string& _name);
     virtual ~Pulse();
 
-    void    start(size_t _milliSec);
+    // Period in microseconds, ticks come from the Context's scheduler
+    void    start(double _period);
     void    stop();
 
-    size_t  index;
+    // Instead of a period, follow a MIDI clock '_division' times per beat
+    // (ex: 4 for sixteenths, 0.25 for bars of 4/4)
+    void    sync(ClockFollower* _clock, double _division);
+    bool    isSynced() const { return clock != nullptr; }
+    bool    isRunning() const { return running; }
+    const ClockFollower* getClock() const { return clock; }
+    double  getDivision() const { return division; }
+
+    // Called by the scheduler on each deadline, queues the tick for the
+    // dispatch thread. Returns false if it wasn't time to send yet (ex:
+    // waiting for the clock to start)
+    bool    tick();
+    void    process(const Table& _table, const MidiEvent& _event);
+
+    // Sets the next deadline
+    void    advance(std::chrono::steady_clock::time_point _now);
+
+    std::chrono::steady_clock::duration getPeriod() const { return period; }
+    double  getPeriodMicros() const { return std::chrono::duration<double, std::micro>(period).count(); }
+
     size_t  defaultOutChannel;
 
+    // Set and updated by the scheduler. The counters are only written by its
+    // thread, and read by stats from another
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<size_t> ticks;
+    std::atomic<size_t> overruns;       // ticks skipped for being more than a period late
+    std::atomic<double> jitterTotal;    // microseconds between the deadline and the tick
+    std::atomic<double> jitterMax;
+
 private:
-    std::thread t;
-    bool        clear = false;
-};
\ No newline at end of file
+    std::chrono::steady_clock::duration period;
+    float       counter;
+    bool        running;
+
+    ClockFollower*  clock;
+    double      division;
+    double      target;     // clock position of the next tick, -1 if unknown
+    size_t      epoch;      // of the clock when the target was set
+    bool        armed;      // the deadline is the target's time
+};
@@ -0,0 +1,154 @@
+#include "Recorder.h"
+
+#include <stdio.h>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "VirtualClock.h"
+
+static FILE*    output = NULL;
+static size_t   records = 0;
+
+bool Recorder::open(const std::string& _filename) {
+    close();
+    records = 0;
+
+    if (!_filename.empty()) {
+        output = fopen(_filename.c_str(), "w");
+        return output != NULL;
+    }
+
+    // The record keeps the real stdout for itself; everything else printed
+    // from now on (load messages with timings, JS errors) goes to stderr,
+    // so two runs can be compared
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        return false;
+
+    output = fdopen(fd, "w");
+    return output != NULL;
+}
+
+bool Recorder::isOpen() {
+    return output != NULL;
+}
+
+void Recorder::close() {
+    if (output)
+        fclose(output);
+    output = NULL;
+}
+
+size_t Recorder::count() {
+    return records;
+}
+
+static void stamp(const std::string& _target) {
+    fprintf(output, "%.6f %s", VirtualClock::seconds(), _target.c_str());
+    records++;
+}
+
+// OSC strings are padded to 4 bytes
+static size_t oscString(const char* _data, size_t _size, size_t _offset, std::string& _out) {
+    size_t end = _offset;
+    while (end < _size && _data[end] != '\0')
+        end++;
+    if (end >= _size)
+        return 0;
+
+    _out.assign(_data + _offset, end - _offset);
+    return (end + 4) & ~size_t(3);
+}
+
+static uint32_t oscInt(const char* _data) {
+    uint32_t v;
+    memcpy(&v, _data, 4);
+    return ntohl(v);
+}
+
+// One line per message, bundles are opened
+static void oscMessage(const std::string& _target, const char* _data, size_t _size) {
+    if (_size >= 16 && memcmp(_data, "#bundle", 8) == 0) {
+        size_t offset = 16;
+        while (offset + 4 <= _size) {
+            size_t size = oscInt(_data + offset);
+            offset += 4;
+            if (offset + size > _size)
+                break;
+            oscMessage(_target, _data + offset, size);
+            offset += size;
+        }
+        return;
+    }
+
+    std::string address, types;
+    size_t offset = oscString(_data, _size, 0, address);
+    if (offset == 0 || (offset = oscString(_data, _size, offset, types)) == 0 || types.empty() || types[0] != ',') {
+        stamp(_target);
+        fprintf(output, " %.*s\n", int(_size), _data);
+        return;
+    }
+
+    stamp(_target);
+    fprintf(output, " %s %s", address.c_str(), types.c_str() + 1);
+
+    for (size_t i = 1; i < types.size(); i++) {
+        if (types[i] == 'f' && offset + 4 <= _size) {
+            uint32_t bits = oscInt(_data + offset);
+            float value;
+            memcpy(&value, &bits, 4);
+            fprintf(output, " %g", value);
+            offset += 4;
+        }
+        else if (types[i] == 'i' && offset + 4 <= _size) {
+            fprintf(output, " %d", int32_t(oscInt(_data + offset)));
+            offset += 4;
+        }
+        else if (types[i] == 's') {
+            std::string str;
+            size_t next = oscString(_data, _size, offset, str);
+            if (next == 0)
+                break;
+            fprintf(output, " %s", str.c_str());
+            offset = next;
+        }
+    }
+    fprintf(output, "\n");
+}
+
+void Recorder::datagram(const std::string& _target, const char* _data, size_t _size) {
+    if (!output)
+        return;
+
+    // OSC, otherwise plain text (udp://)
+    if (_size > 0 && (_data[0] == '/' || _data[0] == '#'))
+        oscMessage(_target, _data, _size);
+    else {
+        stamp(_target);
+        fprintf(output, " %.*s\n", int(_size), _data);
+    }
+}
+
+// same hex bytes as the replay files
+void Recorder::midi(const std::string& _device, const unsigned char* _msg, size_t _size) {
+    if (!output || _size == 0)
+        return;
+
+    stamp(_device);
+    for (size_t i = 0; i < _size; i++)
+        fprintf(output, " %02X", _msg[i]);
+    fprintf(output, "\n");
+}
+
+void Recorder::line(const std::string& _target, const std::string& _line) {
+    if (!output)
+        return;
+
+    stamp(_target);
+    fprintf(output, " %s", _line.c_str());
+    if (_line.empty() || _line[_line.size() - 1] != '\n')
+        fprintf(output, "\n");
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Deterministic sink for the virtual clock mode: instead of going out,
+// every OSC/UDP datagram, MIDI message and CSV line is written as text, one
+// per line, after the virtual time it was sent at:
+//
+//      0.500000 osc://localhost:8000 /knob00 f 0.5
+//      0.500000 Synth 90 3C 64
+//
+// Only used from one thread at a time (the virtual clock runs everything
+// on the main thread).
+//
+class Recorder {
+public:
+
+    // Empty writes to stdout
+    static bool open(const std::string& _filename);
+    static bool isOpen();
+    static void close();
+
+    static void datagram(const std::string& _target, const char* _data, size_t _size);
+    static void midi(const std::string& _device, const unsigned char* _msg, size_t _size);
+    static void line(const std::string& _target, const std::string& _line);
+
+    static size_t count();
+};
@@ -0,0 +1,102 @@
+#include "Scheduler.h"
+
+#include <algorithm>
+
+#include "Pulse.h"
+#include "VirtualClock.h"
+
+Scheduler::Scheduler() : running(false) {
+}
+
+Scheduler::~Scheduler() {
+    if (running) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_one();
+        thread.join();
+    }
+}
+
+void Scheduler::add(Pulse* _pulse) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        _pulse->deadline = VirtualClock::now();
+        _pulse->advance(_pulse->deadline);
+        pulses.push_back(_pulse);
+    }
+
+    if (VirtualClock::isEnabled())
+        return;
+
+    if (!running) {
+        running = true;
+        thread = std::thread(&Scheduler::run, this);
+    }
+    else
+        condition.notify_one();
+}
+
+void Scheduler::remove(Pulse* _pulse) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pulses.erase(std::remove(pulses.begin(), pulses.end(), _pulse), pulses.end());
+}
+
+bool Scheduler::getNextDeadline(std::chrono::steady_clock::time_point& _next) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pulses.empty())
+        return false;
+
+    _next = pulses[0]->deadline;
+    for (size_t i = 1; i < pulses.size(); i++)
+        _next = std::min(_next, pulses[i]->deadline);
+    return true;
+}
+
+void Scheduler::tickDue() {
+    std::lock_guard<std::mutex> lock(mutex);
+    tick();
+}
+
+void Scheduler::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (running) {
+        if (pulses.empty()) {
+            condition.wait(lock);
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point next = pulses[0]->deadline;
+        for (size_t i = 1; i < pulses.size(); i++)
+            next = std::min(next, pulses[i]->deadline);
+
+        // sleep until the closest deadline, unless pulses are added or removed
+        if (condition.wait_until(lock, next) != std::cv_status::timeout)
+            continue;
+
+        // the lock is kept while ticking, so remove() waits for it
+        tick();
+    }
+}
+
+// with the lock taken
+void Scheduler::tick() {
+    for (size_t i = 0; i < pulses.size(); i++) {
+        Pulse* p = pulses[i];
+        std::chrono::steady_clock::time_point now = VirtualClock::now();
+        if (now < p->deadline)
+            continue;
+
+        double late = std::chrono::duration<double, std::micro>(now - p->deadline).count();
+        if (p->tick()) {
+            p->ticks.fetch_add(1, std::memory_order_relaxed);
+            p->jitterTotal.store(p->jitterTotal.load(std::memory_order_relaxed) + late, std::memory_order_relaxed);
+            if (late > p->jitterMax.load(std::memory_order_relaxed))
+                p->jitterMax.store(late, std::memory_order_relaxed);
+        }
+
+        p->advance(VirtualClock::now());
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+class Pulse;
+
+// One thread that drives all the pulses. Each pulse has an absolute deadline
+// on the steady clock that advances by its period, so the time spent
+// processing a tick doesn't add up as drift. When a pulse falls behind more
+// than a whole period the missed ticks are skipped (and counted as overruns)
+// instead of being sent in a burst.
+//
+class Scheduler {
+public:
+
+    Scheduler();
+    virtual ~Scheduler();
+
+    // The first tick is one period after it's added
+    void        add(Pulse* _pulse);
+
+    // Waits for the tick in progress, if any
+    void        remove(Pulse* _pulse);
+
+    // With the virtual clock there is no thread, whoever advances the
+    // time asks for the next deadline and ticks the ones that are due
+    bool        getNextDeadline(std::chrono::steady_clock::time_point& _next);
+    void        tickDue();
+
+protected:
+    void        run();
+    void        tick();
+
+    std::vector<Pulse*>         pulses;
+
+    std::thread                 thread;
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::atomic<bool>           running;
+};
@@ -0,0 +1,429 @@
+#include "Sender.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "Recorder.h"
+
+Sender::Sender(const std::string& _host, const std::string& _port) :
+    host(_host),
+    port(_port),
+    sent(0),
+    errors(0),
+    bundles(0),
+    batches(0),
+    mtu(SENDER_MTU),
+    bundling(true),
+    policy(SEND_DROP_OLDEST),
+    queued(0),
+    dropped(0),
+    coalesced(0),
+    maxDepth(0),
+    fd(-1),
+    bundleSize(0),
+    bundleCount(0),
+    bundleDepth(0),
+    batchSize(0),
+    batchCount(0),
+    batchDepth(0),
+    head(0),
+    tail(0),
+    running(false) {
+    open();
+}
+
+Sender::~Sender() {
+    stop();
+    close();
+}
+
+bool Sender::open() {
+    close();
+    lastOpen = std::chrono::steady_clock::now();
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = 0;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        std::cout << "Failed to resolve " << getKey(host, port) << ": " << gai_strerror(err) << std::endl;
+        return false;
+    }
+
+    for (struct addrinfo* addr = res; addr != NULL; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        // A connected UDP socket skips the route look up on every send
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        std::cout << "Failed to open UDP socket to " << getKey(host, port) << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void Sender::close() {
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+// "#bundle" + the "immediately" time tag
+static const char   BUNDLE_HEADER[16] = { '#', 'b', 'u', 'n', 'd', 'l', 'e', '\0', 0, 0, 0, 0, 0, 0, 0, 1 };
+static const size_t BUNDLE_HEADER_SIZE = 16;
+
+bool Sender::send(const char* _data, size_t _size) {
+    size_t limit = mtu < SENDER_MTU ? mtu : SENDER_MTU;
+
+    // Messages that would never fit a bundle go on their own
+    if (!bundling || bundleDepth == 0 || BUNDLE_HEADER_SIZE + 4 + _size > limit)
+        return queue(_data, _size);
+
+    if (bundleSize + 4 + _size > limit)
+        flushBundle();
+
+    if (bundleCount == 0) {
+        memcpy(bundle, BUNDLE_HEADER, BUNDLE_HEADER_SIZE);
+        bundleSize = BUNDLE_HEADER_SIZE;
+    }
+
+    uint32_t size = htonl((uint32_t)_size);
+    memcpy(bundle + bundleSize, &size, 4);
+    memcpy(bundle + bundleSize + 4, _data, _size);
+    bundleSize += 4 + _size;
+    bundleCount++;
+    return true;
+}
+
+bool Sender::endBundle() {
+    if (bundleDepth == 0)
+        return false;
+
+    if (--bundleDepth > 0)
+        return true;
+
+    return flushBundle();
+}
+
+bool Sender::flushBundle() {
+    if (bundleCount == 0)
+        return true;
+
+    bool rta;
+
+    // A bundle of one is just overhead, send the bare message
+    if (bundleCount == 1)
+        rta = queue(bundle + BUNDLE_HEADER_SIZE + 4, bundleSize - BUNDLE_HEADER_SIZE - 4);
+    else {
+        rta = queue(bundle, bundleSize);
+        bundles.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bundleSize = 0;
+    bundleCount = 0;
+    return rta;
+}
+
+bool Sender::endBatch() {
+    if (batchDepth == 0)
+        return false;
+
+    // the sender thread does its own batching
+    if (--batchDepth > 0 || running)
+        return true;
+
+    return flushBatch();
+}
+
+bool Sender::queue(const char* _data, size_t _size) {
+    // virtual clock: written down instead of sent
+    if (Recorder::isOpen()) {
+        Recorder::datagram(getKey(host, port), _data, _size);
+        sent.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (running)
+        return push(_data, _size);
+
+    if (batchDepth == 0 || _size > SENDER_BATCH_SIZE)
+        return sendPacket(_data, _size);
+
+    if (batchCount == SENDER_BATCH || batchSize + _size > SENDER_BATCH_SIZE)
+        flushBatch();
+
+    memcpy(batch + batchSize, _data, _size);
+    batchOffsets[batchCount] = batchSize;
+    batchSizes[batchCount] = _size;
+    batchSize += _size;
+    batchCount++;
+    return true;
+}
+
+bool Sender::flushBatch() {
+    if (batchCount == 0)
+        return true;
+
+    size_t total = batchCount;
+    batchSize = 0;
+    batchCount = 0;
+
+    if (!ready()) {
+        errors.fetch_add(total, std::memory_order_relaxed);
+        return false;
+    }
+
+    batches.fetch_add(1, std::memory_order_relaxed);
+    bool rta = true;
+
+#ifdef __linux__
+    struct iovec iov[SENDER_BATCH];
+    struct mmsghdr msgs[SENDER_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < total; i++) {
+        iov[i].iov_base = batch + batchOffsets[i];
+        iov[i].iov_len = batchSizes[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t i = 0;
+    while (i < total) {
+        int n = sendmmsg(fd, msgs + i, total - i, 0);
+
+        // the first one failed, skip it and keep going with the rest
+        if (n <= 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            rta = false;
+            i++;
+        }
+        else {
+            sent.fetch_add(n, std::memory_order_relaxed);
+            i += n;
+        }
+    }
+#else
+    for (size_t i = 0; i < total; i++) {
+        if (::send(fd, batch + batchOffsets[i], batchSizes[i], 0) < 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            rta = false;
+        }
+        else
+            sent.fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+
+    return rta;
+}
+
+bool Sender::ready() {
+    // Don't hammer the resolver, try again once per second
+    if (fd < 0 && (std::chrono::steady_clock::now() - lastOpen < std::chrono::seconds(1) || !open()))
+        return false;
+    return true;
+}
+
+bool Sender::sendPacket(const char* _data, size_t _size) {
+    if (!ready()) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (::send(fd, _data, _size, 0) < 0) {
+        // ECONNREFUSED just means nobody is listening (yet)
+        errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void Sender::start(size_t _size, SendPolicy _policy) {
+    stop();
+
+    size_t capacity = 2;
+    while (capacity < _size)
+        capacity <<= 1;
+
+    slots.resize(capacity);
+    for (size_t i = 0; i < capacity; i++)
+        slots[i].reserve(SENDER_MTU);
+
+    policy = _policy;
+    head = tail = 0;
+    latest.clear();
+
+    running = true;
+    thread = std::thread(&Sender::run, this);
+}
+
+void Sender::stop() {
+    if (!running)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        running = false;
+    }
+    queueCondition.notify_one();
+    thread.join();
+}
+
+size_t Sender::depth() {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return size_t(tail - head);
+}
+
+// The OSC addresses a packet carries, separated by '\0': the one of a message,
+// or all the ones inside a #bundle in order. Raw UDP datagrams don't have any
+static bool addressKey(const char* _data, size_t _size, std::string& _key) {
+    if (_size > 0 && _data[0] == '/') {
+        _key.append(_data, strnlen(_data, _size));
+        _key += '\0';
+        return true;
+    }
+
+    if (_size < 16 || memcmp(_data, "#bundle", 8) != 0)
+        return false;
+
+    // "#bundle\0", time tag, then a big endian size before each element
+    size_t offset = 16;
+    while (offset + 4 <= _size) {
+        uint32_t element;
+        memcpy(&element, _data + offset, 4);
+        element = ntohl(element);
+        offset += 4;
+        if (element > _size - offset || !addressKey(_data + offset, element, _key))
+            return false;
+        offset += element;
+    }
+    return offset == _size;
+}
+
+// FNV-1a
+static uint64_t keyHash(const std::string& _key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < _key.size(); i++) {
+        hash ^= (unsigned char)_key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool Sender::push(const char* _data, size_t _size) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        size_t capacity = slots.size();
+
+        uint64_t hash = 0;
+        key.clear();
+        bool hasAddress = policy == SEND_LATEST && addressKey(_data, _size, key);
+        if (hasAddress)
+            hash = keyHash(key);
+
+        // Overwrite the queued message (or bundle) with the same addresses,
+        // this one has newer values for all of them
+        if (hasAddress) {
+            std::unordered_map<uint64_t, uint64_t>::iterator it = latest.find(hash);
+            if (it != latest.end() && it->second >= head && it->second < tail) {
+                std::string& slot = slots[it->second & (capacity - 1)];
+                slotKey.clear();
+                if (addressKey(slot.data(), slot.size(), slotKey) && slotKey == key) {
+                    slot.assign(_data, _size);
+                    coalesced.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+
+        if (tail - head >= capacity) {
+            if (policy == SEND_DROP_NEWEST) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            head++;
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (hasAddress)
+            latest[hash] = tail;
+
+        slots[tail & (capacity - 1)].assign(_data, _size);
+        tail++;
+        queued.fetch_add(1, std::memory_order_relaxed);
+
+        if (tail - head > maxDepth.load(std::memory_order_relaxed))
+            maxDepth.store(tail - head, std::memory_order_relaxed);
+    }
+
+    queueCondition.notify_one();
+    return true;
+}
+
+void Sender::run() {
+    std::string big;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCondition.wait(lock, [&]() { return head != tail || !running; });
+
+            if (head == tail && !running)
+                break;
+
+            // Move as many as fit on one sendmmsg() to the batch buffer
+            size_t capacity = slots.size();
+            while (head != tail && batchCount < SENDER_BATCH) {
+                std::string& slot = slots[head & (capacity - 1)];
+                if (batchSize + slot.size() > SENDER_BATCH_SIZE) {
+                    // too big for any batch, it goes on its own
+                    if (batchCount == 0) {
+                        big.swap(slot);
+                        head++;
+                    }
+                    break;
+                }
+
+                memcpy(batch + batchSize, slot.data(), slot.size());
+                batchOffsets[batchCount] = batchSize;
+                batchSizes[batchCount] = slot.size();
+                batchSize += slot.size();
+                batchCount++;
+                head++;
+            }
+        }
+
+        // the network is hit without holding the lock
+        flushBatch();
+
+        if (!big.empty()) {
+            sendPacket(big.data(), big.size());
+            big.clear();
+        }
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+// Largest UDP payload that fits in a 1500 bytes ethernet frame
+#define SENDER_MTU 1472
+
+// Datagrams (and bytes) held between beginBatch() and endBatch()
+#define SENDER_BATCH 64
+#define SENDER_BATCH_SIZE (16 * 1024)
+
+// What to do when the output queue of a target is full
+//
+enum SendPolicy {
+    SEND_DROP_NEWEST,   // discard the datagram being sent
+    SEND_DROP_OLDEST,   // discard the oldest queued datagram
+    SEND_LATEST         // replace the queued message (or bundle) with the same OSC addresses, otherwise drop the oldest
+};
+
+inline SendPolicy toSendPolicy(const std::string& _string) {
+    if (_string == "drop_newest")
+        return SEND_DROP_NEWEST;
+    else if (_string == "latest")
+        return SEND_LATEST;
+    return SEND_DROP_OLDEST;
+}
+
+inline std::string toString(SendPolicy _policy) {
+    if (_policy == SEND_DROP_NEWEST)
+        return "drop_newest";
+    else if (_policy == SEND_LATEST)
+        return "latest";
+    return "drop_oldest";
+}
+
+// Long lived UDP socket to one host:port. It's resolved and connected once
+// and shared by every binding that sends to the same place.
+//
+// Between beginBatch() and endBatch() datagrams are queued and sent with
+// one sendmmsg() call. Between beginBundle() and endBundle() the OSC
+// messages are also collected into #bundle packets (split at the MTU).
+//
+// Once started, datagrams go to a bounded queue and a thread of its own
+// sends them, so a slow or unreachable target doesn't hold the caller.
+//
+class Sender {
+public:
+
+    Sender(const std::string& _host, const std::string& _port);
+    virtual ~Sender();
+
+    bool        open();
+    void        close();
+    bool        isOpen() const { return fd >= 0; }
+
+    bool        send(const char* _data, size_t _size);
+
+    // ASYNC output queue
+    void        start(size_t _size, SendPolicy _policy);
+    void        stop();
+    bool        isAsync() const { return running; }
+    size_t      depth();
+
+    // Nested calls only flush on the outermost end
+    void        beginBatch() { batchDepth++; }
+    bool        endBatch();
+
+    // OSC BUNDLES
+    void        beginBundle() { bundleDepth++; }
+    bool        endBundle();
+
+    static std::string  getKey(const std::string& _host, const std::string& _port) { return _host + ":" + _port; }
+
+    std::string host;
+    std::string port;
+
+    // counters are read by stats from another thread
+    std::atomic<size_t> sent;
+    std::atomic<size_t> errors;
+    std::atomic<size_t> bundles;
+    std::atomic<size_t> batches;
+    size_t      mtu;
+    bool        bundling;
+
+    SendPolicy  policy;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> dropped;
+    std::atomic<size_t> coalesced;
+    std::atomic<size_t> maxDepth;
+
+protected:
+    bool        push(const char* _data, size_t _size);
+    void        run();
+
+    bool        ready();
+    bool        sendPacket(const char* _data, size_t _size);
+    bool        queue(const char* _data, size_t _size);
+    bool        flushBundle();
+    bool        flushBatch();
+
+    int         fd;
+
+    char        bundle[SENDER_MTU];
+    size_t      bundleSize;
+    size_t      bundleCount;
+    size_t      bundleDepth;
+
+    char        batch[SENDER_BATCH_SIZE];
+    size_t      batchOffsets[SENDER_BATCH];
+    size_t      batchSizes[SENDER_BATCH];
+    size_t      batchSize;
+    size_t      batchCount;
+    size_t      batchDepth;
+
+    std::chrono::steady_clock::time_point lastOpen;
+
+    // ring of datagrams, indices grow monotonically
+    std::vector<std::string>                slots;
+    uint64_t                                head;
+    uint64_t                                tail;
+    std::unordered_map<uint64_t, uint64_t>  latest;     // addresses hash -> index of its last queued packet
+    std::string                             key;        // addresses of the packet being queued
+    std::string                             slotKey;    // and of the one it could replace
+
+    std::thread                             thread;
+    std::mutex                              queueMutex;
+    std::condition_variable                 queueCondition;
+    std::atomic<bool>                       running;
+};
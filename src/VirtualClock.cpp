@@ -0,0 +1,52 @@
+#include "VirtualClock.h"
+
+#include <atomic>
+
+#include "duktape/duktape.h"
+
+// Far enough from the steady clock's epoch so nothing goes negative
+static const std::chrono::steady_clock::time_point VIRTUAL_START(std::chrono::hours(1));
+
+static std::atomic<bool>    enabled(false);
+static std::atomic<int64_t> current(VIRTUAL_START.time_since_epoch().count());
+
+// Date.now() on the shape functions, see duk_midigyver.h
+duk_double_t jsDateNow(void* thr) {
+    (void)thr;
+    if (enabled)
+        return VirtualClock::seconds() * 1000.0;
+
+    return std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void VirtualClock::enable() {
+    current = VIRTUAL_START.time_since_epoch().count();
+    enabled = true;
+}
+
+bool VirtualClock::isEnabled() {
+    return enabled;
+}
+
+std::chrono::steady_clock::time_point VirtualClock::now() {
+    if (enabled)
+        return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(current.load()));
+    return std::chrono::steady_clock::now();
+}
+
+uint64_t VirtualClock::micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(now().time_since_epoch()).count();
+}
+
+double VirtualClock::seconds() {
+    return std::chrono::duration<double>(now() - VIRTUAL_START).count();
+}
+
+void VirtualClock::advance(std::chrono::steady_clock::time_point _time) {
+    if (_time > now())
+        current = _time.time_since_epoch().count();
+}
+
+std::chrono::steady_clock::time_point VirtualClock::start() {
+    return VIRTUAL_START;
+}
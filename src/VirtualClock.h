@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Time of the whole program: the steady clock, unless the virtual clock is
+// on (--virtual-clock). Then time only moves when the simulation advances
+// it, as fast as the events can be processed, so a long session runs in
+// seconds and two runs of the same config see the same timestamps.
+//
+class VirtualClock {
+public:
+
+    static void     enable();
+    static bool     isEnabled();
+
+    static std::chrono::steady_clock::time_point now();
+    static uint64_t micros();           // like MidiEvent::timestamp
+    static double   seconds();          // since it was enabled (virtual only)
+
+    static void     advance(std::chrono::steady_clock::time_point _time);
+    static std::chrono::steady_clock::time_point start();
+};
@@ -12,6 +12,8 @@
 
 #include "Context.h"
 #include "Command.h"
+#include "Recorder.h"
+#include "VirtualClock.h"
 #include "ops/strings.h"
 
 CommandList commands;
@@ -28,12 +30,48 @@ void cinWatcherThread();
 
 int main(int argc, char** argv) {
     if (argc == 1) {
-        std::cout << "Use: " << std::string(argv[0]) << " config.yaml " << std::endl;
+        std::cout << "Use: " << std::string(argv[0]) << " config.yaml [--virtual-clock[=<seconds>] [--replay <file>] [--output <file>]]" << std::endl;
         return 0;
     }
     
     configfile = std::string(argv[1]);
 
+    // Deterministic runs: virtual time, replayed input and recorded output
+    double virtualSeconds = 0.0;
+    std::string replayfile = "";
+    std::string outputfile = "";
+    for (int i = 2; i < argc; i++) {
+        std::string arg = std::string(argv[i]);
+        if (beginsWith(arg, "--virtual-clock")) {
+            VirtualClock::enable();
+            virtualSeconds = arg.size() > 16 ? toFloat(arg.substr(16)) : 60.0;
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+            replayfile = std::string(argv[++i]);
+        else if (arg == "--output" && i + 1 < argc)
+            outputfile = std::string(argv[++i]);
+    }
+
+    if (VirtualClock::isEnabled()) {
+        if (!Recorder::open(outputfile)) {
+            std::cerr << "Can't open " << outputfile << std::endl;
+            return 1;
+        }
+
+        ctx = new Context();
+        bool loaded = ctx->load(configfile);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (loaded)
+            loaded = ctx->simulate(virtualSeconds, replayfile);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        ctx->close();
+        std::cerr << "Simulated " << virtualSeconds << "s in " << elapsed << "s, " << Recorder::count() << " messages recorded" << std::endl;
+        Recorder::close();
+        return loaded ? 0 : 1;
+    }
+
         commands.push_back(Command("help", [&](const std::string& _line){
         if (_line == "help") {
             std::cout << "// " << header << std::endl;
@@ -102,6 +140,23 @@ int main(int argc, char** argv) {
     },
     "save                           save values"));
 
+    commands.push_back(Command("stats", [&](const std::string& _line){
+        if (_line == "stats") {
+            ctx->printStats();
+            return true;
+        }
+        return false;
+    },
+    "stats                          print queues and performance counters"));
+
+    commands.push_back(Command("clock", [&](const std::string& _line){
+        std::vector<std::string> values = split(_line, ',', true);
+        if (values.size() >= 2)
+            return ctx->transport(values[1], values.size() > 2 ? toFloat(values[2]) : 0.0);
+        return false;
+    },
+    "clock,<start|stop|continue|bpm|position>[,<value>]  control the MIDI clock out"));
+
     struct stat st;
     int lastChange;
     bool fileChanged = false;
@@ -119,12 +174,10 @@ int main(int argc, char** argv) {
 
         stat( configfile.c_str(), &st );
         int date = st.st_mtime;
+        // the console commands go on meanwhile, Context takes care of it
         if ( date != lastChange ) {
-            contextMutex.lock();
             lastChange = date;
-            ctx->close();
-            ctx->load(configfile);
-            contextMutex.unlock();
+            ctx->reload(configfile);
         }
 
         #if defined(_WIN32)
@@ -4,9 +4,12 @@
 
 #include "udp.h"
 #include "osc.h"
+#include "../FileWriter.h"
+#include "../Recorder.h"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 template <typename T>
 inline bool broadcast(const Target& _target, const std::string& _prop, const T& _value) {
@@ -15,14 +18,25 @@ inline bool broadcast(const Target& _target, const std::string& _prop, const T&
         return true;
     }
     else if (_target.protocol == CSV_PROTOCOL) {
-        if (_target.isFile) {
+        if (Recorder::isOpen()) {
+            std::ostringstream line;
+            line << _prop << "," << _value;
+            Recorder::line(_target.isFile ? _target.address : "csv", line.str());
+        }
+        else if (_target.writer) {
+            std::ostringstream line;
+            line << _prop << "," << _value << '\n';
+            _target.writer->write(line.str());
+        }
+        else if (_target.isFile) {
             std::ofstream file;
             file.open (_target.address, std::ios_base::app);
             file << _prop << "," << _value << std::endl;
             file.close();
         }
         else {
-            std::cout << _prop << "," << _value << std::endl;
+            // no flush per line, stdout is line buffered on a terminal anyway
+            std::cout << _prop << "," << _value << '\n';
         }
 
         return true;
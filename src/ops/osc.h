@@ -1,36 +1,108 @@
 #pragma once
 
 #include "target.h"
+#include "../Sender.h"
 #include "../types/Color.h"
 #include "../types/Vector.h"
 
 #include <lo/lo.h>
 #include <lo/lo_cpp.h>
 
-inline bool broadcast_OSC(const Target& _target, const std::string& _folder, float _value) {
-    lo_message m = lo_message_new();
-    lo_message_add_float(m, _value);
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <arpa/inet.h>
+
+// Biggest packet encoded on the stack
+#define OSC_BUFFER_SIZE 1024
+
+// Address and type tag of a message, pre-encoded. Sending a value only
+// copies it and appends the big-endian arguments.
+struct OscTemplate {
+    std::string                 header;
+    std::vector<std::string>    on;     // complete packets of buttons/toggles
+    std::vector<std::string>    off;
+
+    bool    isValid() const { return !header.empty(); }
+};
+
+// OSC strings are NUL terminated and padded to 4 bytes
+inline void oscAppendString(std::string& _out, const std::string& _str) {
+    _out += _str;
+    size_t pad = 4 - (_str.size() % 4);
+    _out.append(pad, '\0');
+}
 
-    lo_address t = lo_address_new(_target.address.c_str(), _target.port.c_str());
+inline char* oscWriteFloat(char* _dst, float _value) {
+    uint32_t v;
+    memcpy(&v, &_value, 4);
+    v = htonl(v);
+    memcpy(_dst, &v, 4);
+    return _dst + 4;
+}
 
-    lo_send_message(t, std::string(_target.folder + _folder).c_str(), m);
-    lo_address_free(t);
-    lo_message_free(m);
+inline char* oscWriteString(char* _dst, const std::string& _str) {
+    size_t size = _str.size();
+    size_t pad = 4 - (size % 4);
+    memcpy(_dst, _str.data(), size);
+    memset(_dst + size, 0, pad);
+    return _dst + size + pad;
+}
 
-    return true;
+inline std::string oscHeader(const std::string& _address, const std::string& _typetag) {
+    std::string header;
+    oscAppendString(header, _address);
+    oscAppendString(header, _typetag);
+    return header;
 }
 
-inline bool broadcast_OSC(const Target& _target, const std::string& _folder, const std::string& _value) {
-    lo_message m = lo_message_new();
-    lo_message_add_string(m, _value.c_str());
+inline std::string oscPacket(const std::string& _address, const std::string& _msg) {
+    std::string packet = oscHeader(_address, ",s");
+    oscAppendString(packet, _msg);
+    return packet;
+}
 
-    lo_address t = lo_address_new(_target.address.c_str(), _target.port.c_str());
+// Send a message to a target and free it
+inline bool send_OSC(const Target& _target, const std::string& _folder, lo_message _m) {
+    std::string path = _target.folder + _folder;
+    bool rta = true;
+
+    if (_target.sender) {
+        // Serialise it into a stack buffer and send it through the shared socket
+        char buffer[1024];
+        size_t size = lo_message_length(_m, path.c_str());
+
+        if (size <= sizeof(buffer)) {
+            lo_message_serialise(_m, path.c_str(), buffer, &size);
+            rta = _target.sender->send(buffer, size);
+        }
+        else {
+            void* data = lo_message_serialise(_m, path.c_str(), NULL, &size);
+            rta = _target.sender->send((const char*)data, size);
+            free(data);
+        }
+    }
+    else {
+        lo_address t = lo_address_new(_target.address.c_str(), _target.port.c_str());
+        rta = lo_send_message(t, path.c_str(), _m) >= 0;
+        lo_address_free(t);
+    }
+
+    lo_message_free(_m);
+    return rta;
+}
 
-    lo_send_message(t, std::string(_target.folder + _folder).c_str(), m);
-    lo_address_free(t);
-    lo_message_free(m);
+inline bool broadcast_OSC(const Target& _target, const std::string& _folder, float _value) {
+    lo_message m = lo_message_new();
+    lo_message_add_float(m, _value);
+    return send_OSC(_target, _folder, m);
+}
 
-    return true;
+inline bool broadcast_OSC(const Target& _target, const std::string& _folder, const std::string& _value) {
+    lo_message m = lo_message_new();
+    lo_message_add_string(m, _value.c_str());
+    return send_OSC(_target, _folder, m);
 }
 
 inline bool broadcast_OSC(const Target& _target, const std::string& _folder, Vector _value) {
@@ -38,14 +110,7 @@ inline bool broadcast_OSC(const Target& _target, const std::string& _folder, Vec
     lo_message_add_float(m, _value.x);
     lo_message_add_float(m, _value.y);
     lo_message_add_float(m, _value.z);
-
-    lo_address t = lo_address_new(_target.address.c_str(), _target.port.c_str());
-
-    lo_send_message(t, std::string(_target.folder + _folder).c_str(), m);
-    lo_address_free(t);
-    lo_message_free(m);
-
-    return true;
+    return send_OSC(_target, _folder, m);
 }
 
 inline bool broadcast_OSC(const Target& _target, const std::string& _folder, Color _value) {
@@ -54,12 +119,64 @@ inline bool broadcast_OSC(const Target& _target, const std::string& _folder, Col
     lo_message_add_float(m, _value.g);
     lo_message_add_float(m, _value.b);
     lo_message_add_float(m, _value.a);
+    return send_OSC(_target, _folder, m);
+}
 
-    lo_address t = lo_address_new(_target.address.c_str(), _target.port.c_str());
+// Pre-encoded versions. They need a sender, the callers check it.
 
-    lo_send_message(t, std::string(_target.folder + _folder).c_str(), m);
-    lo_address_free(t);
-    lo_message_free(m);
+inline bool broadcast_OSC(const Target& _target, const std::string& _packet) {
+    return _target.sender->send(_packet.data(), _packet.size());
+}
+
+// Copy the header and append the arguments, returns the packet size
+inline size_t oscEncode(char* _dst, const OscTemplate& _template, float _value) {
+    size_t size = _template.header.size();
+    memcpy(_dst, _template.header.data(), size);
+    return oscWriteFloat(_dst + size, _value) - _dst;
+}
+
+inline size_t oscEncode(char* _dst, const OscTemplate& _template, const Vector& _value) {
+    size_t size = _template.header.size();
+    memcpy(_dst, _template.header.data(), size);
+    char* end = oscWriteFloat(_dst + size, _value.x);
+    end = oscWriteFloat(end, _value.y);
+    return oscWriteFloat(end, _value.z) - _dst;
+}
+
+inline size_t oscEncode(char* _dst, const OscTemplate& _template, const Color& _value) {
+    size_t size = _template.header.size();
+    memcpy(_dst, _template.header.data(), size);
+    char* end = oscWriteFloat(_dst + size, _value.r);
+    end = oscWriteFloat(end, _value.g);
+    end = oscWriteFloat(end, _value.b);
+    return oscWriteFloat(end, _value.a) - _dst;
+}
+
+inline bool broadcast_OSC(const Target& _target, const OscTemplate& _template, float _value) {
+    char buffer[OSC_BUFFER_SIZE];
+    return _target.sender->send(buffer, oscEncode(buffer, _template, _value));
+}
+
+inline bool broadcast_OSC(const Target& _target, const OscTemplate& _template, const std::string& _value) {
+    size_t size = _template.header.size();
+    if (size + _value.size() + 4 > OSC_BUFFER_SIZE) {
+        std::string packet = _template.header;
+        oscAppendString(packet, _value);
+        return broadcast_OSC(_target, packet);
+    }
+
+    char buffer[OSC_BUFFER_SIZE];
+    memcpy(buffer, _template.header.data(), size);
+    char* end = oscWriteString(buffer + size, _value);
+    return _target.sender->send(buffer, end - buffer);
+}
+
+inline bool broadcast_OSC(const Target& _target, const OscTemplate& _template, const Vector& _value) {
+    char buffer[OSC_BUFFER_SIZE];
+    return _target.sender->send(buffer, oscEncode(buffer, _template, _value));
+}
 
-    return true;
+inline bool broadcast_OSC(const Target& _target, const OscTemplate& _template, const Color& _value) {
+    char buffer[OSC_BUFFER_SIZE];
+    return _target.sender->send(buffer, oscEncode(buffer, _template, _value));
 }
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "yaml-cpp/yaml.h"
+
+#include "../JSContext.h"
+
+// Native shaping operations, declared in YAML like:
+//
+//      shape: { op: threshold, min: 64 }
+//
+//      shape:
+//          -   { op: threshold, min: 127 }
+//          -   { op: inc, global: track, max: 8 }
+//
+// They run in order on the raw value (0 ~ 127). A step that returns
+// false stops the event, like a JS shape function returning false.
+//
+enum ShaperOp {
+    SHAPER_NONE = 0,
+    SHAPER_THRESHOLD,   // pass only between min and max
+    SHAPER_CLAMP,       // clamp to min and max
+    SHAPER_INVERT,      // max - value
+    SHAPER_DEADZONE,    // values closer than 'width' to 'center' become 'center'
+    SHAPER_CURVE,       // exp, log or pow curve over 0 ~ max
+    SHAPER_STEP,        // round to multiples of 'step'
+    SHAPER_INC,         // add 'step' to global.<name>, value becomes the result
+    SHAPER_DEC          // subtract 'step' to global.<name>, value becomes the result
+};
+
+enum ShaperCurve {
+    CURVE_EXP = 0,
+    CURVE_LOG,
+    CURVE_POW
+};
+
+struct Shaper {
+    ShaperOp    op      = SHAPER_NONE;
+    ShaperCurve curve   = CURVE_EXP;
+    float       min     = 0.0f;
+    float       max     = 127.0f;
+    float       center  = 64.0f;
+    float       width   = 0.0f;
+    float       amount  = 2.0f;
+    float       step    = 1.0f;
+    std::string global;
+};
+
+inline ShaperOp toShaperOp(const std::string& _op) {
+    if (_op == "threshold")     return SHAPER_THRESHOLD;
+    else if (_op == "clamp")    return SHAPER_CLAMP;
+    else if (_op == "invert")   return SHAPER_INVERT;
+    else if (_op == "deadzone") return SHAPER_DEADZONE;
+    else if (_op == "curve")    return SHAPER_CURVE;
+    else if (_op == "step")     return SHAPER_STEP;
+    else if (_op == "inc")      return SHAPER_INC;
+    else if (_op == "dec")      return SHAPER_DEC;
+    return SHAPER_NONE;
+}
+
+inline bool parseShaper(const YAML::Node& _node, Shaper& _shaper) {
+    if (!_node.IsMap() || !_node["op"].IsDefined())
+        return false;
+
+    std::string op = _node["op"].as<std::string>();
+    _shaper.op = toShaperOp(op);
+    if (_shaper.op == SHAPER_NONE) {
+        std::cout << "Unknown shape op: " << op << std::endl;
+        return false;
+    }
+
+    // inc/dec aren't bounded unless told to
+    if (_shaper.op == SHAPER_INC || _shaper.op == SHAPER_DEC) {
+        _shaper.min = -INFINITY;
+        _shaper.max = INFINITY;
+    }
+
+    if (_node["min"].IsDefined())       _shaper.min = _node["min"].as<float>();
+    if (_node["max"].IsDefined())       _shaper.max = _node["max"].as<float>();
+    if (_node["center"].IsDefined())    _shaper.center = _node["center"].as<float>();
+    if (_node["width"].IsDefined())     _shaper.width = _node["width"].as<float>();
+    if (_node["amount"].IsDefined())    _shaper.amount = _node["amount"].as<float>();
+    if (_node["step"].IsDefined())      _shaper.step = _node["step"].as<float>();
+    if (_node["global"].IsDefined())    _shaper.global = _node["global"].as<std::string>();
+
+    if (_node["curve"].IsDefined()) {
+        std::string curve = _node["curve"].as<std::string>();
+        if (curve == "log")         _shaper.curve = CURVE_LOG;
+        else if (curve == "pow")    _shaper.curve = CURVE_POW;
+        else                        _shaper.curve = CURVE_EXP;
+    }
+
+    if ((_shaper.op == SHAPER_INC || _shaper.op == SHAPER_DEC) && _shaper.global.empty()) {
+        std::cout << "Shape op " << op << " needs a 'global' property to change" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+inline bool applyShaper(const Shaper& _shaper, JSContext& _js, float* _value) {
+    float v = *_value;
+
+    switch (_shaper.op) {
+        case SHAPER_THRESHOLD:
+            return v >= _shaper.min && v <= _shaper.max;
+
+        case SHAPER_CLAMP:
+            *_value = std::min(std::max(v, _shaper.min), _shaper.max);
+            return true;
+
+        case SHAPER_INVERT:
+            *_value = _shaper.max - v;
+            return true;
+
+        case SHAPER_DEADZONE:
+            if (std::fabs(v - _shaper.center) < _shaper.width)
+                *_value = _shaper.center;
+            return true;
+
+        case SHAPER_CURVE: {
+            float x = std::min(std::max(v / _shaper.max, 0.0f), 1.0f);
+            float k = _shaper.amount;
+            if (_shaper.curve == CURVE_EXP)
+                x = (k == 0.0f) ? x : (std::exp(k * x) - 1.0f) / (std::exp(k) - 1.0f);
+            else if (_shaper.curve == CURVE_LOG)
+                x = (k <= 0.0f) ? x : std::log(1.0f + k * x) / std::log(1.0f + k);
+            else
+                x = std::pow(x, k);
+            *_value = x * _shaper.max;
+            return true;
+        }
+
+        case SHAPER_STEP:
+            if (_shaper.step > 0.0f)
+                *_value = std::round(v / _shaper.step) * _shaper.step;
+            return true;
+
+        case SHAPER_INC:
+        case SHAPER_DEC: {
+            float g = 0.0f;
+            _js.getGlobalNumber("global", _shaper.global, &g);
+
+            float n = g + (_shaper.op == SHAPER_INC ? _shaper.step : -_shaper.step);
+            n = std::min(std::max(n, _shaper.min), _shaper.max);
+
+            // at the limit, nothing changes
+            if (n == g)
+                return false;
+
+            _js.setGlobalNumber("global", _shaper.global, n);
+            *_value = n;
+            return true;
+        }
+
+        default:
+            return true;
+    }
+}
+
+inline bool applyShapers(const std::vector<Shaper>& _shapers, JSContext& _js, float* _value) {
+    for (size_t i = 0; i < _shapers.size(); i++)
+        if (!applyShaper(_shapers[i], _js, _value))
+            return false;
+    return true;
+}
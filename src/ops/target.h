@@ -15,12 +15,17 @@ enum TargetProtocol {
     OSC_PROTOCOL        = 4     // NETWORK
 };
 
+class Sender;
+class FileWriter;
+
 struct Target {
     TargetProtocol protocol = UNKNOWN_PROTOCOL;
     std::string address = "localhost";
     std::string port    = "8000";
     std::string folder  = "/";
     bool        isFile  = false;
+    Sender*     sender  = nullptr;  // shared socket, resolved on load
+    FileWriter* writer  = nullptr;  // shared buffered file, opened on load
 };
 
 inline Target parseTarget(const std::string _address) {
@@ -2,11 +2,15 @@
 
 #include "target.h"
 #include "strings.h"
+#include "../Sender.h"
 
 // #include <string>
 // #include <sstream>
 
 #include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,7 +18,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 
-bool sendUDP(const std::string& _hostname, const std::string& _port, const std::string& _msg) {
+// One shot send, for targets without a Sender
+inline bool sendUDP(const std::string& _hostname, const std::string& _port, const std::string& _msg) {
 
     struct addrinfo hints;
     memset(&hints,0,sizeof(hints));
@@ -26,7 +31,7 @@ bool sendUDP(const std::string& _hostname, const std::string& _port, const std::
     struct addrinfo *res = NULL;
     int err = getaddrinfo(_hostname.c_str(), _port.c_str(), &hints, &res);
     if (err != 0) {
-        fprintf(stderr, "Failed to get address info, error: %d\n", errno);
+        fprintf(stderr, "Failed to get address info: %s\n", gai_strerror(err));
         return false;
     }
 
@@ -37,19 +42,21 @@ bool sendUDP(const std::string& _hostname, const std::string& _port, const std::
         return false;
     }
 
-    if ( sendto( sockfd, _msg.c_str(), _msg.size(), 0, res->ai_addr, res->ai_addrlen) < 0) {
-        printf("%s",strerror(errno));
-        return false;
-    }
+    bool rta = sendto( sockfd, _msg.c_str(), _msg.size(), 0, res->ai_addr, res->ai_addrlen) >= 0;
+    if (!rta)
+        fprintf(stderr, "Failed to send UDP message: %s\n", strerror(errno));
 
     close(sockfd);
     freeaddrinfo(res);
-    return true;
+    return rta;
 }
 
 template <typename T>
 inline bool broadcast_UDP(const Target& _target, const std::string& _prop, const T& _value) {
     std::string msg = toString(_value);
+
+    if (_target.sender)
+        return _target.sender->send(msg.c_str(), msg.size());
+
     return sendUDP(_target.address, _target.port, msg);
 }
-